@@ -0,0 +1,507 @@
+#define _GNU_SOURCE
+#include "autoindex.h"
+#include "netlib.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <time.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/inotify.h>
+
+// Directory changes that make a cached listing stale
+#define WATCH_MASK (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                    IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | \
+                    IN_DELETE_SELF | IN_MOVE_SELF | IN_ONLYDIR)
+
+typedef struct dir_entry {
+    char *name;
+    int is_dir;
+    long long size;
+    time_t mtime;
+} dir_entry;
+
+// Rendered listing, shared between the cache and threads sending it
+typedef struct listing_body {
+    atomic_int refs;
+    size_t len;
+    char data[];
+} listing_body;
+
+typedef struct cache_entry {
+    char path[512];              // empty = unused slot
+    int wd;                      // inotify watch on path
+    unsigned generation;         // bumped whenever the entry is invalidated
+    listing_body *body[2];       // [0] = HTML, [1] = JSON
+    unsigned long last_used;
+} cache_entry;
+
+// Output target: a growing buffer, or a chunked stream for big directories
+typedef struct listing_out {
+    chunk_stream *stream;
+    char *buf;
+    size_t len;
+    size_t cap;
+    int failed;
+} listing_out;
+
+static atomic_int g_enabled = 0;
+static int g_inotify_fd = -1;
+static pthread_once_t g_init_once = PTHREAD_ONCE_INIT;
+static pthread_mutex_t g_cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+static cache_entry g_cache[AUTOINDEX_CACHE_SLOTS];
+static unsigned long g_tick = 0;
+
+
+void autoindex_set_enabled(int enabled) {
+    atomic_store(&g_enabled, enabled ? 1 : 0);
+}
+
+int autoindex_enabled(void) {
+    return atomic_load(&g_enabled);
+}
+
+static void init_cache(void) {
+    for (size_t i = 0; i < AUTOINDEX_CACHE_SLOTS; i++)
+        g_cache[i].wd = -1;
+
+    g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (g_inotify_fd < 0)
+        log_message(LOG_WARNING, "inotify unavailable, directory listings won't be cached: %s",
+                    strerror(errno));
+}
+
+static void release_body(listing_body *body) {
+    if (body && atomic_fetch_sub(&body->refs, 1) == 1)
+        free(body);
+}
+
+static void invalidate_entry(cache_entry *entry) {
+    release_body(entry->body[0]);
+    release_body(entry->body[1]);
+    entry->body[0] = NULL;
+    entry->body[1] = NULL;
+    entry->generation++;
+}
+
+static void drop_entry(cache_entry *entry) {
+    invalidate_entry(entry);
+
+    // Paths that resolve to the same directory share one watch
+    int shared = 0;
+    for (size_t i = 0; i < AUTOINDEX_CACHE_SLOTS; i++) {
+        if (&g_cache[i] != entry && g_cache[i].path[0] && g_cache[i].wd == entry->wd)
+            shared = 1;
+    }
+    if (!shared && entry->wd >= 0)
+        inotify_rm_watch(g_inotify_fd, entry->wd);
+
+    entry->path[0] = '\0';
+    entry->wd = -1;
+}
+
+/**
+ * Apply queued inotify events to the cache
+ * Non-blocking: costs one read() returning EAGAIN when nothing changed.
+ * Caller holds g_cache_mutex.
+ */
+static void drain_events(void) {
+    char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+
+    for (;;) {
+        ssize_t len = read(g_inotify_fd, buf, sizeof(buf));
+        if (len <= 0)
+            return;
+
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            p += sizeof(struct inotify_event) + ev->len;
+
+            for (size_t i = 0; i < AUTOINDEX_CACHE_SLOTS; i++) {
+                cache_entry *entry = &g_cache[i];
+                if (!entry->path[0])
+                    continue;
+                if (ev->mask & IN_Q_OVERFLOW) {
+                    invalidate_entry(entry);
+                } else if (entry->wd == ev->wd) {
+                    invalidate_entry(entry);
+                    // Watch is gone (directory deleted or moved)
+                    if (ev->mask & IN_IGNORED) {
+                        entry->path[0] = '\0';
+                        entry->wd = -1;
+                    }
+                }
+            }
+        }
+    }
+}
+
+static cache_entry *find_entry(const char *dirpath) {
+    for (size_t i = 0; i < AUTOINDEX_CACHE_SLOTS; i++) {
+        if (g_cache[i].path[0] && strcmp(g_cache[i].path, dirpath) == 0)
+            return &g_cache[i];
+    }
+    return NULL;
+}
+
+/**
+ * Take a free (or least recently used) slot and start watching dirpath
+ * @return entry, or NULL if the path can't be watched
+ */
+static cache_entry *claim_entry(const char *dirpath) {
+    if (strlen(dirpath) >= sizeof(g_cache[0].path))
+        return NULL;
+
+    cache_entry *victim = NULL;
+    for (size_t i = 0; i < AUTOINDEX_CACHE_SLOTS; i++) {
+        if (!g_cache[i].path[0]) {
+            victim = &g_cache[i];
+            break;
+        }
+        if (!victim || g_cache[i].last_used < victim->last_used)
+            victim = &g_cache[i];
+    }
+    if (victim->path[0])
+        drop_entry(victim);
+
+    int wd = inotify_add_watch(g_inotify_fd, dirpath, WATCH_MASK);
+    if (wd < 0)
+        return NULL;
+
+    snprintf(victim->path, sizeof(victim->path), "%s", dirpath);
+    victim->wd = wd;
+    victim->last_used = ++g_tick;
+    return victim;
+}
+
+static void out_write(listing_out *out, const char *data, size_t len) {
+    if (out->failed)
+        return;
+
+    if (out->stream) {
+        if (!chunk_stream_write(out->stream, data, len))
+            out->failed = 1;
+        return;
+    }
+
+    if (out->len + len > out->cap) {
+        size_t cap = out->cap ? out->cap * 2 : 8192;
+        while (cap < out->len + len)
+            cap *= 2;
+        char *grown = realloc(out->buf, cap);
+        if (!grown) {
+            out->failed = 1;
+            return;
+        }
+        out->buf = grown;
+        out->cap = cap;
+    }
+    memcpy(out->buf + out->len, data, len);
+    out->len += len;
+}
+
+static void out_str(listing_out *out, const char *s) {
+    out_write(out, s, strlen(s));
+}
+
+static void out_printf(listing_out *out, const char *format, ...) {
+    char line[256];
+    va_list args;
+    va_start(args, format);
+    int len = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (len > 0)
+        out_write(out, line, (size_t)len < sizeof(line) ? (size_t)len : sizeof(line) - 1);
+}
+
+/**
+ * Write a file name escaped for HTML text or a JSON string
+ */
+static void out_escaped(listing_out *out, const char *s, int json) {
+    for (; *s; s++) {
+        unsigned char c = (unsigned char)*s;
+        if (json) {
+            if (c == '"' || c == '\\') {
+                char esc[2] = { '\\', (char)c };
+                out_write(out, esc, 2);
+            } else if (c < 0x20) {
+                out_printf(out, "\\u%04x", c);
+            } else {
+                out_write(out, s, 1);
+            }
+        } else {
+            switch (c) {
+                case '&':  out_str(out, "&amp;"); break;
+                case '<':  out_str(out, "&lt;"); break;
+                case '>':  out_str(out, "&gt;"); break;
+                case '"':  out_str(out, "&quot;"); break;
+                case '\'': out_str(out, "&#39;"); break;
+                default:   out_write(out, s, 1); break;
+            }
+        }
+    }
+}
+
+/**
+ * Write a file name percent-encoded for use in a link
+ */
+static void out_href(listing_out *out, const char *s, size_t len) {
+    static const char hex[] = "0123456789ABCDEF";
+    for (const char *end = s + len; s < end; s++) {
+        unsigned char c = (unsigned char)*s;
+        if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+            c == '-' || c == '_' || c == '.' || c == '~' || c == '/') {
+            out_write(out, s, 1);
+        } else {
+            char enc[3] = { '%', hex[c >> 4], hex[c & 15] };
+            out_write(out, enc, 3);
+        }
+    }
+}
+
+static void render_header(listing_out *out, const char *url_path, int json) {
+    if (json) {
+        out_str(out, "[");
+        return;
+    }
+
+    out_str(out, "<!DOCTYPE html>\n<html><head><meta charset=\"utf-8\"><title>Index of ");
+    out_escaped(out, url_path, 0);
+    out_str(out, "</title></head>\n<body><h1>Index of ");
+    out_escaped(out, url_path, 0);
+    out_str(out, "</h1>\n<table>\n<tr><th>Name</th><th>Size</th><th>Modified</th></tr>\n");
+    if (strcmp(url_path, "/") != 0) {
+        // Absolute like the entry links: a relative "../" resolves against
+        // the request URL, which is one level off when it lacks the slash
+        size_t parent_len = strlen(url_path) - 1;
+        while (parent_len > 0 && url_path[parent_len - 1] != '/')
+            parent_len--;
+        out_str(out, "<tr><td><a href=\"");
+        out_href(out, url_path, parent_len);
+        out_str(out, "\">../</a></td><td></td><td></td></tr>\n");
+    }
+}
+
+static void render_entry(listing_out *out, const char *url_path, const dir_entry *entry,
+                         int json, int first) {
+    if (json) {
+        out_str(out, first ? "\n{\"name\":\"" : ",\n{\"name\":\"");
+        out_escaped(out, entry->name, 1);
+        out_printf(out, "\",\"type\":\"%s\",\"size\":%lld,\"mtime\":%lld}",
+                   entry->is_dir ? "dir" : "file", entry->size, (long long)entry->mtime);
+        return;
+    }
+
+    char modified[32];
+    struct tm tm_info;
+    gmtime_r(&entry->mtime, &tm_info);
+    strftime(modified, sizeof(modified), "%Y-%m-%d %H:%M", &tm_info);
+
+    out_str(out, "<tr><td><a href=\"");
+    out_href(out, url_path, strlen(url_path));
+    out_href(out, entry->name, strlen(entry->name));
+    out_str(out, entry->is_dir ? "/\">" : "\">");
+    out_escaped(out, entry->name, 0);
+    out_str(out, entry->is_dir ? "/" : "");
+    if (entry->is_dir)
+        out_printf(out, "</a></td><td>-</td><td>%s</td></tr>\n", modified);
+    else
+        out_printf(out, "</a></td><td>%lld</td><td>%s</td></tr>\n", entry->size, modified);
+}
+
+static void render_footer(listing_out *out, int json) {
+    out_str(out, json ? "\n]\n" : "</table>\n</body></html>\n");
+}
+
+static int stat_entry(int dir_fd, const char *name, dir_entry *entry) {
+    struct stat st;
+    if (fstatat(dir_fd, name, &st, 0) != 0)
+        return 0;
+    entry->is_dir = S_ISDIR(st.st_mode);
+    entry->size = (long long)st.st_size;
+    entry->mtime = st.st_mtime;
+    return 1;
+}
+
+static int compare_entries(const void *a, const void *b) {
+    const dir_entry *ea = a;
+    const dir_entry *eb = b;
+    // Directories first, then by name
+    if (ea->is_dir != eb->is_dir)
+        return eb->is_dir - ea->is_dir;
+    return strcmp(ea->name, eb->name);
+}
+
+static const char *listing_content_type(int json) {
+    return json ? "application/json" : "text/html; charset=utf-8";
+}
+
+/**
+ * Read a directory and render its listing
+ * Small directories are sorted and rendered into *body_out for the caller
+ * to send (and cache). Past AUTOINDEX_MAX_CACHED entries the listing is
+ * streamed to the client unsorted as readdir() returns entries, so memory
+ * use doesn't grow with the directory size.
+ *
+ * @return HTTP status code (already sent to the client when streaming)
+ */
+static int build_listing(int client_fd, const char *dirpath, const char *url_path, int json,
+                         int keep_alive, int can_chunk, listing_body **body_out,
+                         int *cacheable, size_t *bytes_sent) {
+    *body_out = NULL;
+    *cacheable = 0;
+    *bytes_sent = 0;
+
+    DIR *dir = opendir(dirpath);
+    if (!dir)
+        return errno == ENOENT || errno == ENOTDIR ? 404 : 403;
+    trace_mark(TRACE_OPENED);
+    int dir_fd = dirfd(dir);
+
+    dir_entry *entries = malloc(AUTOINDEX_MAX_CACHED * sizeof(dir_entry));
+    if (!entries) {
+        closedir(dir);
+        return 500;
+    }
+
+    size_t count = 0;
+    int large = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        // Hidden files (and . / ..) are not listed
+        if (de->d_name[0] == '.')
+            continue;
+        if (count == AUTOINDEX_MAX_CACHED) {
+            large = 1;
+            break;
+        }
+        if (!stat_entry(dir_fd, de->d_name, &entries[count]))
+            continue;
+        entries[count].name = strdup(de->d_name);
+        if (entries[count].name)
+            count++;
+    }
+
+    listing_out out = {0};
+    chunk_stream stream;
+    if (large && can_chunk) {
+        if (!chunk_stream_begin(&stream, client_fd, listing_content_type(json), keep_alive)) {
+            out.failed = 1;
+        }
+        out.stream = &stream;
+    } else if (!large) {
+        qsort(entries, count, sizeof(dir_entry), compare_entries);
+    }
+
+    render_header(&out, url_path, json);
+    for (size_t i = 0; i < count; i++)
+        render_entry(&out, url_path, &entries[i], json, i == 0);
+
+    // Rest of a large directory: render straight from readdir()
+    size_t rendered = count;
+    if (large) {
+        do {
+            if (de->d_name[0] == '.')
+                continue;
+            dir_entry entry = { .name = de->d_name };
+            if (stat_entry(dir_fd, de->d_name, &entry))
+                render_entry(&out, url_path, &entry, json, rendered++ == 0);
+        } while (!out.failed && (de = readdir(dir)) != NULL);
+    }
+    render_footer(&out, json);
+
+    for (size_t i = 0; i < count; i++)
+        free(entries[i].name);
+    free(entries);
+    closedir(dir);
+
+    if (out.stream) {
+        if (out.failed || !chunk_stream_end(&stream))
+            shutdown(client_fd, SHUT_RDWR);
+        *bytes_sent = stream.bytes_sent;
+        return 200;
+    }
+
+    listing_body *body = out.failed ? NULL : malloc(sizeof(listing_body) + out.len);
+    if (!body) {
+        free(out.buf);
+        return 500;
+    }
+    atomic_init(&body->refs, 1);
+    body->len = out.len;
+    memcpy(body->data, out.buf, out.len);
+    free(out.buf);
+
+    *body_out = body;
+    *cacheable = !large;
+    return 200;
+}
+
+/**
+ * Send a cached or freshly rendered directory listing
+ */
+int serve_directory_listing(int client_fd, const char *dirpath, const char *url_path,
+                            int json, int keep_alive, int can_chunk, size_t *bytes_sent) {
+    pthread_once(&g_init_once, init_cache);
+    json = json ? 1 : 0;
+    *bytes_sent = 0;
+
+    listing_body *body = NULL;
+    cache_entry *entry = NULL;
+    unsigned generation = 0;
+
+    if (g_inotify_fd >= 0) {
+        pthread_mutex_lock(&g_cache_mutex);
+        drain_events();
+
+        entry = find_entry(dirpath);
+        if (entry && entry->body[json]) {
+            body = entry->body[json];
+            atomic_fetch_add(&body->refs, 1);
+            entry->last_used = ++g_tick;
+        } else if (!entry) {
+            // Watch before reading, so changes made mid-render are seen
+            entry = claim_entry(dirpath);
+        }
+        if (entry)
+            generation = entry->generation;
+        pthread_mutex_unlock(&g_cache_mutex);
+    }
+
+    if (!body) {
+        int cacheable = 0;
+        int status = build_listing(client_fd, dirpath, url_path, json, keep_alive, can_chunk,
+                                   &body, &cacheable, bytes_sent);
+        if (!body) {
+            if (status != 200)
+                send_error_response(client_fd, status, keep_alive);
+            return status;
+        }
+
+        if (entry && cacheable) {
+            pthread_mutex_lock(&g_cache_mutex);
+            drain_events();
+            // Only store if nothing changed (or evicted the slot) meanwhile
+            if (entry->generation == generation && strcmp(entry->path, dirpath) == 0 &&
+                !entry->body[json]) {
+                atomic_fetch_add(&body->refs, 1);
+                entry->body[json] = body;
+            }
+            pthread_mutex_unlock(&g_cache_mutex);
+        }
+    }
+
+    send_response(client_fd, 200, listing_content_type(json), body->data, body->len,
+                  keep_alive, NULL);
+    *bytes_sent = body->len;
+    release_body(body);
+    return 200;
+}
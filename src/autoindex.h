@@ -0,0 +1,32 @@
+#ifndef AUTOINDEX_H
+#define AUTOINDEX_H
+#include <stddef.h>
+
+/**
+ * Directory listings for -d mode
+ *
+ * Listings are rendered as HTML or JSON (name, size, mtime), cached per
+ * directory and invalidated through inotify, so repeated hits don't
+ * re-run readdir + stat for every entry. Directories with more than
+ * AUTOINDEX_MAX_CACHED entries are not cached: they are streamed out
+ * with chunked encoding as they are read.
+ */
+
+#define AUTOINDEX_CACHE_SLOTS  64
+#define AUTOINDEX_MAX_CACHED   5000
+
+void autoindex_set_enabled(int enabled);
+int autoindex_enabled(void);
+
+/**
+ * Send a listing of dirpath
+ * @param url_path  - Request path, used for links (must end with '/')
+ * @param json      - Render JSON instead of HTML
+ * @param can_chunk - Client accepts chunked encoding (HTTP/1.1)
+ * @param bytes_sent - Body bytes sent
+ * @return HTTP status code of the response that was sent
+ */
+int serve_directory_listing(int client_fd, const char *dirpath, const char *url_path,
+                            int json, int keep_alive, int can_chunk, size_t *bytes_sent);
+
+#endif
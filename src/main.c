@@ -1,30 +1,460 @@
 /**
  * HTTP/1.1 Server with Command-Line Arguments
- * 
+ *
  * Usage:
  *   ./server -f <file>           Serve single file to all requests
  *   ./server -d <directory>      Serve files from directory
  *   ./server -p <port>           Custom port (default: 4221)
+ *   ./server -c <config>         Read directory/file/log settings from a file
+ *   ./server -R <n> -C <n>       Limit requests/sec and open connections per client
+ *   ./server -d <directory> -i   List directories that have no index.html
+ *   ./server -t <file> -S <n>    Write per-request stage timings for 1 in n requests
+ *   ./server -u /api/=host:port  Forward a path prefix to backend(s)
+ *   ./server -a :: -o push=cork  Bind address and socket tuning
+ *
+ * Signals:
+ *   SIGTERM, SIGQUIT, SIGINT     Stop accepting, drain in-flight requests, exit
+ *   SIGHUP                       Re-read the config file and reopen the log
+ *   SIGUSR1                      Reopen the log file (log rotation)
+ *   SIGUSR2                      Exec a new server binary on the same listening
+ *                                socket, then drain and exit (binary upgrade)
  */
 
+#define _GNU_SOURCE
 #include <sched.h>
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/socket.h>
+#include <sys/wait.h>
 #include <netinet/in.h>
 #include <netinet/ip.h>
 #include <arpa/inet.h>
 #include <string.h>
 #include <errno.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
 #include "netlib.h"
+#include "ratelimit.h"
+#include "autoindex.h"
+#include "trace.h"
+#include "proxy.h"
 #include <pthread.h>
 
+// Environment variable used to pass the listening socket to a new binary
+#define LISTEN_FD_ENV "HTTP_SERVER_LISTEN_FD"
+
+// Pipe the new binary writes to once it is accepting connections
+#define READY_FD_ENV "HTTP_SERVER_READY_FD"
+
+// Seconds a new binary gets to start up before the handoff is abandoned
+#define HANDOFF_READY_TIMEOUT_SEC 10
+
+// Seconds to wait for in-flight connections before exiting anyway
+#define DRAIN_TIMEOUT_SEC 30
+
 // Global configuration
 char *g_directory = NULL;
 char *g_single_file = NULL;
-static char *g_log_file = NULL;
+static char g_log_path[256] = {0};
+static char *g_config_file = NULL;
+static rl_limits g_limits = {0};
+
+// Command-line settings; they override the config file at startup and on reload
+static const char *g_cli_directory = NULL;
+static const char *g_cli_single_file = NULL;
+static const char *g_cli_log_file = NULL;
+static rl_limits g_cli_limits = { -1, -1, -1 };
+static int g_cli_autoindex = -1;
+
+// Lifecycle state shared with client threads
+volatile sig_atomic_t g_draining = 0;
+atomic_int g_active_connections = 0;
+
+// Set from signal handlers, acted on by the accept loop
+static volatile sig_atomic_t g_shutdown_requested = 0;
+static volatile sig_atomic_t g_reload_requested = 0;
+static volatile sig_atomic_t g_reopen_requested = 0;
+static volatile sig_atomic_t g_handoff_requested = 0;
+
+extern char **environ;
+
+
+static void handle_signal(int sig) {
+    switch (sig) {
+        case SIGTERM:
+        case SIGQUIT:
+        case SIGINT:  g_shutdown_requested = 1; break;
+        case SIGHUP:  g_reload_requested = 1; break;
+        case SIGUSR1: g_reopen_requested = 1; break;
+        case SIGUSR2: g_handoff_requested = 1; break;
+    }
+}
+
+/**
+ * Install lifecycle signal handlers
+ * No SA_RESTART, so a signal interrupts poll() in the accept loop right away
+ */
+static int install_signal_handlers(void) {
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handle_signal;
+    sigemptyset(&sa.sa_mask);
+
+    int signals[] = { SIGTERM, SIGQUIT, SIGINT, SIGHUP, SIGUSR1, SIGUSR2 };
+    for (size_t i = 0; i < sizeof(signals) / sizeof(signals[0]); i++) {
+        if (sigaction(signals[i], &sa, NULL) != 0)
+            return 0;
+    }
+
+    // A client that disconnects mid-response must not kill the process
+    signal(SIGPIPE, SIG_IGN);
+    return 1;
+}
+
+/**
+ * Check that directory/single-file settings are usable
+ * @return 1 if valid, 0 otherwise (reason is logged)
+ */
+static int validate_mode(const char *directory, const char *single_file) {
+    if (directory && single_file) {
+        log_message(LOG_ERROR, "Cannot use both a directory and a single file");
+        return 0;
+    }
+
+    if (single_file) {
+        FILE *fp = fopen(single_file, "rb");
+        if (!fp) {
+            log_message(LOG_ERROR, "Cannot open file '%s': %s", single_file, strerror(errno));
+            return 0;
+        }
+        fclose(fp);
+    }
+    return 1;
+}
+
+/**
+ * Re-read the config file (if any) and reopen the log file
+ * Only settings the file sets are replaced, and command-line flags still
+ * override it, as at startup. Invalid configs are rejected and the running
+ * settings are kept.
+ */
+static void reload_configuration(void) {
+    if (g_config_file) {
+        server_config cfg;
+        if (!read_config_file(g_config_file, &cfg)) {
+            log_message(LOG_ERROR, "Reload failed: cannot read config '%s'", g_config_file);
+            return;
+        }
+
+        // -d/-f pin the serving paths; without them keep the current ones unless the file sets new ones
+        if (!g_cli_directory && !g_cli_single_file && (cfg.directory[0] || cfg.single_file[0])) {
+            const char *directory = cfg.directory[0] ? cfg.directory : NULL;
+            const char *single_file = cfg.single_file[0] ? cfg.single_file : NULL;
+            if (!validate_mode(directory, single_file)) {
+                log_message(LOG_ERROR, "Reload failed: keeping previous configuration");
+                return;
+            }
+            set_serving_paths(directory, single_file);
+        }
+
+        if (cfg.rate_limit >= 0 && g_cli_limits.requests_per_sec < 0)
+            g_limits.requests_per_sec = cfg.rate_limit;
+        if (cfg.rate_burst >= 0 && g_cli_limits.burst < 0)
+            g_limits.burst = cfg.rate_burst;
+        if (cfg.max_connections >= 0 && g_cli_limits.max_connections < 0)
+            g_limits.max_connections = cfg.max_connections;
+        rl_configure(&g_limits);
+
+        if (cfg.autoindex >= 0 && g_cli_autoindex < 0)
+            autoindex_set_enabled(cfg.autoindex);
+
+        if (cfg.log_file[0] && !g_cli_log_file)
+            snprintf(g_log_path, sizeof(g_log_path), "%s", cfg.log_file);
+
+        char directory[512];
+        char single_file[512];
+        get_serving_paths(directory, sizeof(directory), single_file, sizeof(single_file));
+        log_message(LOG_INFO, "Configuration reloaded: %s (%s)",
+                    single_file[0] ? "Single file" : "Directory",
+                    single_file[0] ? single_file : directory);
+    }
+
+    reopen_logging(g_log_path[0] ? g_log_path : NULL);
+}
+
+/**
+ * Create, bind and listen on a new TCP socket
+ * @param bind_addr - Numeric address; NULL binds "::" dual-stack, or
+ *                    0.0.0.0 when the host has no IPv6
+ * @return listening socket, or -1 on error
+ */
+static int open_listener(const char *bind_addr, int port, int reuse_port,
+                         const socket_options *opts) {
+    struct in6_addr probe;
+    const char *addr = bind_addr ? bind_addr : "::";
+    int family = inet_pton(AF_INET6, addr, &probe) == 1 ? AF_INET6 : AF_INET;
+
+    /**
+     * Create TCP socket
+     * SOCK_STREAM: TCP, 0: default protocol
+     */
+    int server_fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server_fd == -1 && !bind_addr && errno == EAFNOSUPPORT) {
+        addr = "0.0.0.0";
+        family = AF_INET;
+        server_fd = socket(family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    }
+
+    if (server_fd == -1) {
+        log_message(LOG_ERROR, "Socket creation failed: %s", strerror(errno));
+        return -1;
+    }
+
+    /**
+     * Enable SO_REUSEADDR to prevent "Address already in use" errors
+     * Allows immediate port reuse after server restart
+     */
+    int reuse = 1;
+    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
+        printf("SO_REUSEADDR failed: %s \n", strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    /**
+     * SO_REUSEPORT lets an old and a new server instance listen on the
+     * same port at once, so they can overlap during a restart
+     */
+    if (reuse_port &&
+        setsockopt(server_fd, SOL_SOCKET, SO_REUSEPORT, &reuse, sizeof(reuse)) < 0) {
+        printf("SO_REUSEPORT failed: %s \n", strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    /**
+     * IPv6 sockets also accept IPv4 clients (as ::ffff:a.b.c.d) unless v6only
+     */
+    if (family == AF_INET6) {
+        int v6only = opts->v6only ? 1 : 0;
+        if (setsockopt(server_fd, IPPROTO_IPV6, IPV6_V6ONLY, &v6only, sizeof(v6only)) < 0) {
+            printf("IPV6_V6ONLY failed: %s \n", strerror(errno));
+            close(server_fd);
+            return -1;
+        }
+    }
+
+    apply_listener_options(server_fd, opts);
+
+    /**
+     * Configure server address and bind to port
+     */
+    if (!set_server_adds(server_fd, addr, port))
+        return -1;
+
+    if (listen(server_fd, opts->backlog) != 0) {
+        printf("Listen failed: %s \n", strerror(errno));
+        close(server_fd);
+        return -1;
+    }
+
+    return server_fd;
+}
+
+/**
+ * Pick up a listening socket handed over by a previous server process
+ * @return inherited socket, or -1 if none was passed
+ */
+static int inherited_listener(void) {
+    const char *value = getenv(LISTEN_FD_ENV);
+    if (!value)
+        return -1;
+
+    int fd = atoi(value);
+    unsetenv(LISTEN_FD_ENV);
+
+    int accepting = 0;
+    socklen_t len = sizeof(accepting);
+    if (fd <= 2 || getsockopt(fd, SOL_SOCKET, SO_ACCEPTCONN, &accepting, &len) != 0 || !accepting) {
+        log_message(LOG_WARNING, "Ignoring invalid inherited listening socket '%s'", value);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+    return fd;
+}
+
+/**
+ * Tell the process that exec'd us that we are accepting connections
+ * It keeps serving until then, so a new binary that fails at startup
+ * leaves the old one running.
+ */
+static void notify_ready(void) {
+    const char *value = getenv(READY_FD_ENV);
+    if (!value)
+        return;
+
+    int fd = atoi(value);
+    unsetenv(READY_FD_ENV);
+    if (fd <= 2)
+        return;
+
+    char ready = 1;
+    if (write(fd, &ready, 1) != 1)
+        log_message(LOG_WARNING, "Cannot signal readiness to previous process: %s", strerror(errno));
+    close(fd);
+}
+
+/**
+ * Exec a new server process that inherits the listening socket
+ * Connections keep queueing on the shared socket, so none are refused
+ * while the new process starts up.
+ * @return 1 once the new process is accepting, 0 if it failed to start
+ */
+static int spawn_successor(int server_fd, char **av) {
+    // Build the child's environment up front: only exec-safe calls after fork()
+    size_t env_count = 0;
+    while (environ[env_count])
+        env_count++;
+
+    char **envp = malloc((env_count + 3) * sizeof(char *));
+    if (!envp) {
+        log_message(LOG_ERROR, "Handoff failed: %s", strerror(errno));
+        return 0;
+    }
+
+    // Closed on successful exec; carries errno back if exec fails
+    int status_pipe[2];
+    if (pipe2(status_pipe, O_CLOEXEC) != 0) {
+        log_message(LOG_ERROR, "Handoff failed: %s", strerror(errno));
+        free(envp);
+        return 0;
+    }
+
+    // Kept open across exec; the new process writes a byte once it accepts
+    int ready_pipe[2];
+    if (pipe2(ready_pipe, O_CLOEXEC) != 0) {
+        log_message(LOG_ERROR, "Handoff failed: %s", strerror(errno));
+        close(status_pipe[0]);
+        close(status_pipe[1]);
+        free(envp);
+        return 0;
+    }
+
+    char fd_var[64];
+    char ready_var[64];
+    snprintf(fd_var, sizeof(fd_var), "%s=%d", LISTEN_FD_ENV, server_fd);
+    snprintf(ready_var, sizeof(ready_var), "%s=%d", READY_FD_ENV, ready_pipe[1]);
+    size_t n = 0;
+    for (size_t i = 0; i < env_count; i++) {
+        if (strncmp(environ[i], LISTEN_FD_ENV "=", strlen(LISTEN_FD_ENV) + 1) != 0 &&
+            strncmp(environ[i], READY_FD_ENV "=", strlen(READY_FD_ENV) + 1) != 0)
+            envp[n++] = environ[i];
+    }
+    envp[n++] = fd_var;
+    envp[n++] = ready_var;
+    envp[n] = NULL;
+
+    pid_t pid = fork();
+    if (pid < 0) {
+        log_message(LOG_ERROR, "Handoff failed: fork: %s", strerror(errno));
+        close(status_pipe[0]);
+        close(status_pipe[1]);
+        close(ready_pipe[0]);
+        close(ready_pipe[1]);
+        free(envp);
+        return 0;
+    }
+
+    if (pid == 0) {
+        close(status_pipe[0]);
+        close(ready_pipe[0]);
+        fcntl(server_fd, F_SETFD, 0);
+        fcntl(ready_pipe[1], F_SETFD, 0);
+        execvpe(av[0], av, envp);
+        int err = errno;
+        if (write(status_pipe[1], &err, sizeof(err)) < 0) {
+            // Nothing more we can report
+        }
+        _exit(127);
+    }
+
+    close(status_pipe[1]);
+    close(ready_pipe[1]);
+    free(envp);
+
+    int child_err = 0;
+    ssize_t got;
+    do {
+        got = read(status_pipe[0], &child_err, sizeof(child_err));
+    } while (got < 0 && errno == EINTR);
+    close(status_pipe[0]);
+
+    if (got > 0) {
+        log_message(LOG_ERROR, "Handoff failed: exec '%s': %s", av[0], strerror(child_err));
+        close(ready_pipe[0]);
+        waitpid(pid, NULL, 0);
+        return 0;
+    }
+
+    /**
+     * Keep the listening socket until the new process is accepting; if it
+     * exits during startup (bad config, unwritable log...) the pipe hits
+     * EOF and this process carries on serving
+     */
+    char ready = 0;
+    struct pollfd pfd = { .fd = ready_pipe[0], .events = POLLIN };
+    int waited;
+    do {
+        waited = poll(&pfd, 1, HANDOFF_READY_TIMEOUT_SEC * 1000);
+    } while (waited < 0 && errno == EINTR);
+    if (waited > 0) {
+        do {
+            got = read(ready_pipe[0], &ready, 1);
+        } while (got < 0 && errno == EINTR);
+    }
+    close(ready_pipe[0]);
+
+    if (ready != 1) {
+        log_message(LOG_ERROR, "Handoff failed: new process (pid %d) %s", (int)pid,
+                    waited > 0 ? "exited during startup" : "did not become ready");
+        if (waited <= 0)
+            kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        return 0;
+    }
+
+    log_message(LOG_INFO, "Handed listening socket to new process (pid %d)", (int)pid);
+    return 1;
+}
+
+/**
+ * Wait for in-flight connections to finish
+ * Client threads see g_draining, finish their current response with
+ * "Connection: close" and drop idle keep-alive connections.
+ */
+static void drain_connections(int timeout_sec) {
+    g_draining = 1;
+
+    int active = atomic_load(&g_active_connections);
+    if (active > 0)
+        log_message(LOG_INFO, "Draining %d active connection(s)...", active);
+
+    struct timespec tick = { .tv_sec = 0, .tv_nsec = 100 * 1000 * 1000 };
+    for (int waited = 0; waited < timeout_sec * 10; waited++) {
+        if (atomic_load(&g_active_connections) == 0)
+            return;
+        nanosleep(&tick, NULL);
+    }
+
+    log_message(LOG_WARNING, "Drain timeout: %d connection(s) still open",
+                atomic_load(&g_active_connections));
+}
 
 
 int main(int ac, char **av) {
@@ -33,16 +463,29 @@ int main(int ac, char **av) {
     setbuf(stderr, NULL);
 
     int port = 4221;
+    int reuse_port = 0;
     int opt;
+    char *directory = NULL;
+    char *single_file = NULL;
+    char *log_file = NULL;
+    rl_limits cli_limits = { -1, -1, -1 };
+    int autoindex = -1;
+    char *trace_file = NULL;
+    unsigned trace_sample = 1;
+    char *upstreams[CONFIG_MAX_UPSTREAMS];
+    int upstream_count = 0;
+    char *balance = NULL;
+    char *bind_addr = NULL;
+    char *sock_spec = NULL;
 
     // Parse command-line arguments
-    while ((opt = getopt(ac, av, "d:f:p:l:h")) != -1) {
+    while ((opt = getopt(ac, av, "d:f:p:l:c:rR:B:C:it:S:u:b:a:o:h")) != -1) {
         switch (opt) {
             case 'd':
-                g_directory = optarg;
+                directory = optarg;
                 break;
             case 'f':
-                g_single_file = optarg;
+                single_file = optarg;
                 break;
             case 'p':
                 port = atoi(optarg);
@@ -52,129 +495,305 @@ int main(int ac, char **av) {
                 }
                 break;
             case 'l':
-                g_log_file = optarg;
+                log_file = optarg;
+                break;
+            case 'c':
+                g_config_file = optarg;
+                break;
+            case 'r':
+                reuse_port = 1;
+                break;
+            case 'R':
+                cli_limits.requests_per_sec = atoi(optarg);
+                break;
+            case 'B':
+                cli_limits.burst = atoi(optarg);
+                break;
+            case 'C':
+                cli_limits.max_connections = atoi(optarg);
+                break;
+            case 'i':
+                autoindex = 1;
+                break;
+            case 't':
+                trace_file = optarg;
+                break;
+            case 'S':
+                if (atoi(optarg) <= 0) {
+                    fprintf(stderr, "Error: Invalid sample rate\n");
+                    return 1;
+                }
+                trace_sample = (unsigned)atoi(optarg);
+                break;
+            case 'u':
+                if (upstream_count == CONFIG_MAX_UPSTREAMS) {
+                    fprintf(stderr, "Error: Too many upstreams\n");
+                    return 1;
+                }
+                upstreams[upstream_count++] = optarg;
+                break;
+            case 'b':
+                balance = optarg;
+                break;
+            case 'a':
+                bind_addr = optarg;
+                break;
+            case 'o':
+                sock_spec = optarg;
                 break;
             case 'h':
             default:
-                fprintf(stderr, "Usage: %s [-d directory] [-f file] [-p port] [-l logfile]\n", av[0]);
+                fprintf(stderr, "Usage: %s [-d directory] [-f file] [-p port] [-l logfile] [-c config] [-r] [-R rate] [-B burst] [-C conns] [-i] [-t tracefile] [-S n] [-u upstream] [-b balance] [-a addr] [-o opts]\n", av[0]);
                 fprintf(stderr, "  -d <directory>  Serve files from directory\n");
                 fprintf(stderr, "  -f <file>       Serve single file to all requests\n");
                 fprintf(stderr, "  -p <port>       Port number (default: 4221)\n");
                 fprintf(stderr, "  -l <logfile>    Log file path (default: stdout only)\n");
+                fprintf(stderr, "  -c <config>     Config file, re-read on SIGHUP\n");
+                fprintf(stderr, "  -r              Enable SO_REUSEPORT for overlapping restarts\n");
+                fprintf(stderr, "  -R <rate>       Requests/sec per client IP (default: unlimited)\n");
+                fprintf(stderr, "  -B <burst>      Request burst per client IP (default: rate)\n");
+                fprintf(stderr, "  -C <conns>      Open connections per client IP (default: unlimited)\n");
+                fprintf(stderr, "  -i              List directories without index.html (HTML or JSON)\n");
+                fprintf(stderr, "  -t <tracefile>  Write binary per-request timing trace\n");
+                fprintf(stderr, "  -S <n>          Trace 1 in n requests (default: 1)\n");
+                fprintf(stderr, "  -u <route>      Proxy /prefix=host:port[,host:port] (repeatable)\n");
+                fprintf(stderr, "  -b <balance>    round_robin or least_conn (default: round_robin)\n");
+                fprintf(stderr, "  -a <addr>       Listen address (default: :: dual-stack, else 0.0.0.0)\n");
+                fprintf(stderr, "  -o <opts>       Socket options, e.g. backlog=1024,push=cork,fastopen=0\n");
                 return (opt == 'h') ? 0 : 1;
         }
-    } 
+    }
 
-    // Validate arguments
+    g_cli_directory = directory;
+    g_cli_single_file = single_file;
+    g_cli_log_file = log_file;
+    g_cli_limits = cli_limits;
+    g_cli_autoindex = autoindex;
 
-    if (g_directory && g_single_file) {
-        fprintf(stderr, "Error: Cannot use both -d and -f\n");
-        return 1;
+    // Config file values apply first, command-line flags override them
+    server_config cfg;
+    if (g_config_file) {
+        if (!read_config_file(g_config_file, &cfg)) {
+            fprintf(stderr, "Error: Cannot read config file '%s'\n", g_config_file);
+            return 1;
+        }
+        if (!directory && !single_file) {
+            if (cfg.directory[0])
+                directory = cfg.directory;
+            if (cfg.single_file[0])
+                single_file = cfg.single_file;
+        }
+        if (!log_file && cfg.log_file[0])
+            log_file = cfg.log_file;
+        g_limits.requests_per_sec = cfg.rate_limit > 0 ? cfg.rate_limit : 0;
+        g_limits.burst = cfg.rate_burst > 0 ? cfg.rate_burst : 0;
+        g_limits.max_connections = cfg.max_connections > 0 ? cfg.max_connections : 0;
+        if (autoindex < 0 && cfg.autoindex >= 0)
+            autoindex = cfg.autoindex;
+        if (upstream_count == 0) {
+            for (int i = 0; i < cfg.upstream_count; i++)
+                upstreams[upstream_count++] = cfg.upstreams[i];
+        }
+        if (!balance && cfg.upstream_balance[0])
+            balance = cfg.upstream_balance;
+        if (!bind_addr && cfg.bind_addr[0])
+            bind_addr = cfg.bind_addr;
     }
 
-    if (g_single_file) {
-        FILE *fp = fopen(g_single_file, "rb");
-        if (!fp) {
-            log_message(LOG_ERROR, "Cannot open file '%s': %s", g_single_file, strerror(errno));
+    // Socket options: defaults, then config file, then -o
+    socket_options sock_opts;
+    default_socket_options(&sock_opts);
+    if (g_config_file && cfg.socket_options[0] &&
+        !parse_socket_options(cfg.socket_options, &sock_opts))
+        return 1;
+    if (sock_spec && !parse_socket_options(sock_spec, &sock_opts))
+        return 1;
+    set_socket_options(&sock_opts);
+
+    if (balance) {
+        if (strcmp(balance, "least_conn") == 0) {
+            proxy_set_balance(PROXY_LEAST_CONN);
+        } else if (strcmp(balance, "round_robin") != 0) {
+            fprintf(stderr, "Error: Unknown balance mode '%s'\n", balance);
             return 1;
         }
-        fclose(fp);
-        log_message(LOG_INFO, "Server mode: Single file (%s)", g_single_file);
-    } else if (g_directory) {
-        log_message(LOG_INFO, "Server mode: Directory (%s)", g_directory);
+    }
+    for (int i = 0; i < upstream_count; i++) {
+        if (!proxy_add_route(upstreams[i]))
+            return 1;
+    }
+
+    if (cli_limits.requests_per_sec >= 0)
+        g_limits.requests_per_sec = cli_limits.requests_per_sec;
+    if (cli_limits.burst >= 0)
+        g_limits.burst = cli_limits.burst;
+    if (cli_limits.max_connections >= 0)
+        g_limits.max_connections = cli_limits.max_connections;
+    rl_configure(&g_limits);
+    autoindex_set_enabled(autoindex > 0);
+
+    if (log_file)
+        snprintf(g_log_path, sizeof(g_log_path), "%s", log_file);
+
+    // Validate arguments
+
+    if (!validate_mode(directory, single_file))
+        return 1;
+
+    if (single_file) {
+        log_message(LOG_INFO, "Server mode: Single file (%s)", single_file);
+    } else if (directory) {
+        log_message(LOG_INFO, "Server mode: Directory (%s)", directory);
     } else {
-        g_directory = ".";
+        directory = ".";
         log_message(LOG_INFO, "Server mode: Directory (current directory)");
     }
 
+    set_serving_paths(directory, single_file);
+
     int server_fd, client_fd;
-    int client_addr_len;
-    struct sockaddr_in client_addr;
-    
-    init_logging(g_log_file);
+    socklen_t client_addr_len;
+    struct sockaddr_storage client_addr;
+    char client_ip[INET6_ADDRSTRLEN];
+
+    init_logging(g_log_path[0] ? g_log_path : NULL);
     log_message(LOG_INFO, "Server starting...");
-    
-    /**
-     * Create TCP socket (IPv4)
-     * AF_INET: IPv4, SOCK_STREAM: TCP, 0: default protocol
-     */
-    server_fd = socket(AF_INET, SOCK_STREAM, 0);
 
-    if (server_fd == -1) {
-    log_message(LOG_ERROR, "Socket creation failed: %s", strerror(errno));
-    close_logging();
-    return 1;
+    if (trace_file && !trace_init(trace_file, trace_sample)) {
+        close_logging();
+        return 1;
     }
 
-    /**
-     * Enable SO_REUSEADDR to prevent "Address already in use" errors
-     * Allows immediate port reuse after server restart
-     */
-    int reuse = 1;
-    if (setsockopt(server_fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)) < 0) {
-        printf("SO_REUSEADDR failed: %s \n", strerror(errno));
-        close(server_fd);
+    if (!install_signal_handlers()) {
+        log_message(LOG_ERROR, "Signal setup failed: %s", strerror(errno));
+        close_logging();
         return 1;
     }
 
-    /**
-     * Configure server address and bind to port
-     */
-    set_server_adds(server_fd, port);
-
-    /**
-     * Start listening with backlog of 7 connections
-     */
-    int connection_backlog = 7;
-    if (listen(server_fd, connection_backlog) != 0) {
-        printf("Listen failed: %s \n", strerror(errno));
-        close(server_fd);
-        return 1;
+    server_fd = inherited_listener();
+    if (server_fd != -1) {
+        log_message(LOG_INFO, "Inherited listening socket from previous process");
+    } else {
+        server_fd = open_listener(bind_addr, port, reuse_port, &sock_opts);
+        if (server_fd == -1) {
+            close_logging();
+            return 1;
+        }
     }
 
+    // Non-blocking, so a connection taken by another process can't stall accept()
+    fcntl(server_fd, F_SETFL, fcntl(server_fd, F_GETFL) | O_NONBLOCK);
+    notify_ready();
+
     printf("Server listening on port %d...\n", port);
-    client_addr_len = sizeof(client_addr);
 
     log_message(LOG_INFO, "Server listening on port %d", port);
-    
+
+    // Client threads never handle lifecycle signals; the accept loop does
+    sigset_t worker_mask;
+    sigemptyset(&worker_mask);
+    sigaddset(&worker_mask, SIGTERM);
+    sigaddset(&worker_mask, SIGQUIT);
+    sigaddset(&worker_mask, SIGINT);
+    sigaddset(&worker_mask, SIGHUP);
+    sigaddset(&worker_mask, SIGUSR1);
+    sigaddset(&worker_mask, SIGUSR2);
+
     /**
-     * Accept incoming connections (blocks until client connects)
-     * Returns new socket descriptor for this specific client
+     * Accept incoming connections until asked to stop
+     * poll() wakes up on new connections or when a signal arrives
      */
-    while (1) {
-        client_fd = accept(server_fd, (struct sockaddr *)&client_addr,
-                          (socklen_t *)&client_addr_len);
+    while (!g_shutdown_requested) {
+        if (g_reload_requested) {
+            g_reload_requested = 0;
+            reload_configuration();
+        }
+        if (g_reopen_requested) {
+            g_reopen_requested = 0;
+            reopen_logging(g_log_path[0] ? g_log_path : NULL);
+        }
+        if (g_handoff_requested) {
+            g_handoff_requested = 0;
+            if (spawn_successor(server_fd, av))
+                break;
+        }
+
+        struct pollfd pfd = { .fd = server_fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, 1000);
+        if (ready < 0 && errno != EINTR) {
+            log_message(LOG_ERROR, "poll failed: %s", strerror(errno));
+            break;
+        }
+        if (ready <= 0)
+            continue;
+
+        client_addr_len = sizeof(client_addr);
+        client_fd = accept4(server_fd, (struct sockaddr *)&client_addr,
+                            &client_addr_len, SOCK_CLOEXEC);
 
         if (client_fd == -1) {
+            if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK ||
+                errno == ECONNABORTED)
+                continue;
             printf("Accept failed: %s\n", strerror(errno));
-            close(server_fd);
-            return 1;
+            break;
+        }
+
+        // Per-client connection cap, checked before a thread is spent on it
+        uint64_t client_key = rl_key_from_addr((struct sockaddr *)&client_addr);
+        int rl_slot = -1;
+        if (!rl_acquire_connection(client_key, &rl_slot)) {
+            format_peer_addr(&client_addr, client_ip, sizeof(client_ip));
+            send_error_response(client_fd, 429, 0);
+            log_request(client_ip, "-", "-", 429, 0);
+            close(client_fd);
+            continue;
         }
 
         pthread_t t;
-        int *client_fd_ptr = malloc(sizeof(int));
-        if (client_fd_ptr == NULL) {
+        client_conn *conn = malloc(sizeof(client_conn));
+        if (conn == NULL) {
             printf("allocation failed %s \n", strerror(errno));
+            rl_release_connection(rl_slot);
             close(client_fd);
             continue;
         }
 
-        *client_fd_ptr = client_fd;
+        conn->fd = client_fd;
+        conn->key = client_key;
+        conn->rl_slot = rl_slot;
 
-        if (pthread_create(&t, NULL, handel_client, client_fd_ptr) != 0) {
+        // Counted before the thread starts so a drain can't miss it
+        atomic_fetch_add(&g_active_connections, 1);
+
+        sigset_t old_mask;
+        pthread_sigmask(SIG_BLOCK, &worker_mask, &old_mask);
+        int create_failed = pthread_create(&t, NULL, handel_client, conn) != 0;
+        pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+
+        if (create_failed) {
             perror("failed to create a thread");
-            free(client_fd_ptr);
+            atomic_fetch_sub(&g_active_connections, 1);
+            rl_release_connection(rl_slot);
+            free(conn);
             close(client_fd);
             continue;
         }
 
         pthread_detach(t);
         /* Log client connection info */
-        printf("Client IP: %s\n", inet_ntoa(client_addr.sin_addr));
-        printf("Client Port: %d\n", ntohs(client_addr.sin_port));
+        format_peer_addr(&client_addr, client_ip, sizeof(client_ip));
+        printf("Client IP: %s\n", client_ip);
+        printf("Client Port: %d\n", ntohs(client_addr.ss_family == AF_INET6
+                                           ? ((struct sockaddr_in6 *)&client_addr)->sin6_port
+                                           : ((struct sockaddr_in *)&client_addr)->sin_port));
     }
 
+    // Stop accepting; a successor (if any) keeps the socket open
     close(server_fd);
+    drain_connections(DRAIN_TIMEOUT_SEC);
+
+    trace_shutdown();
 
     log_message(LOG_INFO, "Server shutting down");
     close_logging();
@@ -1,4 +1,8 @@
 #include "netlib.h"
+#include "ratelimit.h"
+#include "autoindex.h"
+#include "trace.h"
+#include "proxy.h"
 #include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -13,23 +17,65 @@
 #include <unistd.h>
 #include <stdarg.h>
 #include <pthread.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <ctype.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <netinet/tcp.h>
 
 // External global variables from main.c
 extern char *g_directory;
 extern char *g_single_file;
+extern volatile sig_atomic_t g_draining;
+extern atomic_int g_active_connections;
 static FILE *g_log_file = NULL;
+static socket_options g_socket_options = { .push = PUSH_NODELAY };
 static pthread_mutex_t g_log_mutex = PTHREAD_MUTEX_INITIALIZER;
 
+// Guards g_directory / g_single_file against SIGHUP reloads
+static pthread_rwlock_t g_config_lock = PTHREAD_RWLOCK_INITIALIZER;
 
-int set_server_adds(int server_fd, int port) {
-    struct sockaddr_in serv_addr = { 
-        .sin_family = AF_INET,
-        .sin_port = htons(port),
-        .sin_addr = { htonl(INADDR_ANY) },
-    };
+// Idle keep-alive timeout, checked in slices so a drain is noticed quickly
+#define KEEPALIVE_TIMEOUT_MS 5000
+#define DRAIN_POLL_MS 200
+
+// Room for the "<hex size>\r\n" line in front of each chunk
+#define CHUNK_PREFIX_LEN 10
+
+// Per-thread chunk buffer, reused for every streamed response
+static __thread char g_chunk_buf[CHUNK_PREFIX_LEN + STREAM_CHUNK_SIZE + 2];
+
+
+/**
+ * Bind to an IPv4 or IPv6 address (an IPv6 socket must be created for "::")
+ * @param bind_addr - Numeric address, e.g. "0.0.0.0", "::" or "127.0.0.1"
+ */
+int set_server_adds(int server_fd, const char *bind_addr, int port) {
+    struct sockaddr_storage serv_addr;
+    socklen_t addr_len;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+
+    struct sockaddr_in *v4 = (struct sockaddr_in *)&serv_addr;
+    struct sockaddr_in6 *v6 = (struct sockaddr_in6 *)&serv_addr;
+    if (inet_pton(AF_INET, bind_addr, &v4->sin_addr) == 1) {
+        v4->sin_family = AF_INET;
+        v4->sin_port = htons(port);
+        addr_len = sizeof(*v4);
+    } else if (inet_pton(AF_INET6, bind_addr, &v6->sin6_addr) == 1) {
+        v6->sin6_family = AF_INET6;
+        v6->sin6_port = htons(port);
+        addr_len = sizeof(*v6);
+    } else {
+        printf("Invalid bind address: %s \n", bind_addr);
+        close(server_fd);
+        return 0;
+    }
     
     /* Bind socket to address and port */
-    if (bind(server_fd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) != 0) {
+    if (bind(server_fd, (struct sockaddr *) &serv_addr, addr_len) != 0) {
         printf("Bind failed: %s \n", strerror(errno));
         close(server_fd);
         return 0;
@@ -37,6 +83,268 @@ int set_server_adds(int server_fd, int port) {
     return 1;   
 }
 
+/**
+ * Defaults: a real backlog and TCP_NODELAY; the rest stay off because they
+ * did not help on loopback (see "Socket Tuning" in the README)
+ */
+void default_socket_options(socket_options *opts) {
+    opts->backlog = 511;
+    opts->defer_accept = 0;
+    opts->fastopen = 0;
+    opts->push = PUSH_NODELAY;
+    opts->sndbuf = 0;
+    opts->rcvbuf = 0;
+    opts->busy_poll = 0;
+    opts->v6only = 0;
+}
+
+/**
+ * Parse "key=value,key=value" socket options on top of the current values
+ * Keys: backlog, defer_accept, fastopen, push (nagle|nodelay|cork),
+ * sndbuf, rcvbuf, busy_poll, v6only.
+ * @return 1 on success, 0 on an unknown key or bad value
+ */
+int parse_socket_options(const char *spec, socket_options *opts) {
+    char buf[256];
+    snprintf(buf, sizeof(buf), "%s", spec);
+
+    char *save = NULL;
+    for (char *item = strtok_r(buf, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        char *value = strchr(item, '=');
+        if (!value) {
+            fprintf(stderr, "Socket option '%s' needs a value\n", item);
+            return 0;
+        }
+        *value++ = '\0';
+
+        int *target = NULL;
+        if (strcmp(item, "backlog") == 0)           target = &opts->backlog;
+        else if (strcmp(item, "defer_accept") == 0) target = &opts->defer_accept;
+        else if (strcmp(item, "fastopen") == 0)     target = &opts->fastopen;
+        else if (strcmp(item, "sndbuf") == 0)       target = &opts->sndbuf;
+        else if (strcmp(item, "rcvbuf") == 0)       target = &opts->rcvbuf;
+        else if (strcmp(item, "busy_poll") == 0)    target = &opts->busy_poll;
+        else if (strcmp(item, "v6only") == 0)       target = &opts->v6only;
+
+        if (target) {
+            char *end;
+            long n = strtol(value, &end, 10);
+            if (*end != '\0' || n < 0 || n > 1 << 30) {
+                fprintf(stderr, "Invalid value for socket option %s: %s\n", item, value);
+                return 0;
+            }
+            *target = (int)n;
+        } else if (strcmp(item, "push") == 0) {
+            if (strcmp(value, "nagle") == 0)        opts->push = PUSH_NAGLE;
+            else if (strcmp(value, "nodelay") == 0) opts->push = PUSH_NODELAY;
+            else if (strcmp(value, "cork") == 0)    opts->push = PUSH_CORK;
+            else {
+                fprintf(stderr, "push must be nagle, nodelay or cork\n");
+                return 0;
+            }
+        } else {
+            fprintf(stderr, "Unknown socket option '%s'\n", item);
+            return 0;
+        }
+    }
+    return 1;
+}
+
+void set_socket_options(const socket_options *opts) {
+    g_socket_options = *opts;
+}
+
+/**
+ * Options set before bind()/listen() on the listening socket
+ * Failures are logged and otherwise ignored: every option is an optimization.
+ */
+void apply_listener_options(int server_fd, const socket_options *opts) {
+    if (opts->defer_accept > 0 &&
+        setsockopt(server_fd, IPPROTO_TCP, TCP_DEFER_ACCEPT,
+                   &opts->defer_accept, sizeof(opts->defer_accept)) < 0)
+        log_message(LOG_WARNING, "TCP_DEFER_ACCEPT failed: %s", strerror(errno));
+
+    if (opts->fastopen > 0 &&
+        setsockopt(server_fd, IPPROTO_TCP, TCP_FASTOPEN,
+                   &opts->fastopen, sizeof(opts->fastopen)) < 0)
+        log_message(LOG_WARNING, "TCP_FASTOPEN failed: %s", strerror(errno));
+
+    // Accepted sockets inherit buffer sizes from the listener
+    if (opts->sndbuf > 0 &&
+        setsockopt(server_fd, SOL_SOCKET, SO_SNDBUF, &opts->sndbuf, sizeof(opts->sndbuf)) < 0)
+        log_message(LOG_WARNING, "SO_SNDBUF failed: %s", strerror(errno));
+    if (opts->rcvbuf > 0 &&
+        setsockopt(server_fd, SOL_SOCKET, SO_RCVBUF, &opts->rcvbuf, sizeof(opts->rcvbuf)) < 0)
+        log_message(LOG_WARNING, "SO_RCVBUF failed: %s", strerror(errno));
+}
+
+/**
+ * Options set on each accepted socket
+ */
+void apply_connection_options(int client_fd, const socket_options *opts) {
+    if (opts->push == PUSH_NODELAY) {
+        int one = 1;
+        setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+    if (opts->busy_poll > 0)
+        setsockopt(client_fd, SOL_SOCKET, SO_BUSY_POLL, &opts->busy_poll, sizeof(opts->busy_poll));
+}
+
+/**
+ * Hold back partial segments while a response is being written (push=cork)
+ * Uncorking sends whatever is queued immediately.
+ */
+static void set_cork(int client_fd, int on) {
+    if (g_socket_options.push == PUSH_CORK)
+        setsockopt(client_fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+}
+
+/**
+ * Client address as text; IPv4 clients of a dual-stack listener are shown
+ * as plain IPv4 instead of ::ffff:a.b.c.d
+ */
+void format_peer_addr(const struct sockaddr_storage *addr, char *out, size_t out_len) {
+    if (addr->ss_family == AF_INET) {
+        inet_ntop(AF_INET, &((const struct sockaddr_in *)addr)->sin_addr, out, (socklen_t)out_len);
+    } else if (addr->ss_family == AF_INET6) {
+        const struct in6_addr *a6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6))
+            inet_ntop(AF_INET, &a6->s6_addr[12], out, (socklen_t)out_len);
+        else
+            inet_ntop(AF_INET6, a6, out, (socklen_t)out_len);
+    } else {
+        snprintf(out, out_len, "unknown");
+    }
+}
+
+/**
+ * Read "key = value" settings from a config file
+ * Recognised keys: directory, file, log, rate_limit, rate_burst, max_connections,
+ * autoindex, upstream (repeatable), upstream_balance, bind, socket_options.
+ * Blank lines and '#' comments are skipped.
+ *
+ * @param path - Config file path
+ * @param cfg  - Filled with the settings found (missing keys are empty strings)
+ * @return 1 on success, 0 if the file can't be read or has an unknown key
+ */
+int read_config_file(const char *path, server_config *cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->rate_limit = -1;
+    cfg->rate_burst = -1;
+    cfg->max_connections = -1;
+    cfg->autoindex = -1;
+
+    FILE *fp = fopen(path, "re");
+    if (!fp) {
+        log_message(LOG_ERROR, "Cannot open config '%s': %s", path, strerror(errno));
+        return 0;
+    }
+
+    char line[512];
+    int line_no = 0;
+    int ok = 1;
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+
+        // Trim comments and surrounding whitespace
+        char *hash = strchr(line, '#');
+        if (hash) *hash = '\0';
+        char *key = line;
+        while (isspace((unsigned char)*key)) key++;
+        if (*key == '\0') continue;
+
+        char *eq = strchr(key, '=');
+        if (!eq) {
+            log_message(LOG_ERROR, "%s:%d: expected 'key = value'", path, line_no);
+            ok = 0;
+            break;
+        }
+
+        char *value = eq + 1;
+        char *end = eq;
+        while (end > key && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+        while (isspace((unsigned char)*value)) value++;
+        end = value + strlen(value);
+        while (end > value && isspace((unsigned char)end[-1])) end--;
+        *end = '\0';
+
+        char *dest;
+        size_t dest_len;
+        if (strcmp(key, "directory") == 0) {
+            dest = cfg->directory; dest_len = sizeof(cfg->directory);
+        } else if (strcmp(key, "file") == 0) {
+            dest = cfg->single_file; dest_len = sizeof(cfg->single_file);
+        } else if (strcmp(key, "log") == 0) {
+            dest = cfg->log_file; dest_len = sizeof(cfg->log_file);
+        } else if (strcmp(key, "rate_limit") == 0) {
+            cfg->rate_limit = atoi(value);
+            continue;
+        } else if (strcmp(key, "rate_burst") == 0) {
+            cfg->rate_burst = atoi(value);
+            continue;
+        } else if (strcmp(key, "max_connections") == 0) {
+            cfg->max_connections = atoi(value);
+            continue;
+        } else if (strcmp(key, "upstream") == 0) {
+            if (cfg->upstream_count == CONFIG_MAX_UPSTREAMS) {
+                log_message(LOG_ERROR, "%s:%d: too many upstreams", path, line_no);
+                ok = 0;
+                break;
+            }
+            dest = cfg->upstreams[cfg->upstream_count++];
+            dest_len = sizeof(cfg->upstreams[0]);
+        } else if (strcmp(key, "upstream_balance") == 0) {
+            dest = cfg->upstream_balance; dest_len = sizeof(cfg->upstream_balance);
+        } else if (strcmp(key, "bind") == 0) {
+            dest = cfg->bind_addr; dest_len = sizeof(cfg->bind_addr);
+        } else if (strcmp(key, "socket_options") == 0) {
+            dest = cfg->socket_options; dest_len = sizeof(cfg->socket_options);
+        } else if (strcmp(key, "autoindex") == 0) {
+            cfg->autoindex = strcmp(value, "on") == 0 || strcmp(value, "1") == 0;
+            continue;
+        } else {
+            log_message(LOG_ERROR, "%s:%d: unknown setting '%s'", path, line_no, key);
+            ok = 0;
+            break;
+        }
+        snprintf(dest, dest_len, "%s", value);
+    }
+
+    fclose(fp);
+    return ok;
+}
+
+/**
+ * Replace the directory / single file being served
+ * Safe to call while client threads are running.
+ */
+void set_serving_paths(const char *directory, const char *single_file) {
+    char *new_dir = directory ? strdup(directory) : NULL;
+    char *new_file = single_file ? strdup(single_file) : NULL;
+
+    pthread_rwlock_wrlock(&g_config_lock);
+    char *old_dir = g_directory;
+    char *old_file = g_single_file;
+    g_directory = new_dir;
+    g_single_file = new_file;
+    pthread_rwlock_unlock(&g_config_lock);
+
+    free(old_dir);
+    free(old_file);
+}
+
+/**
+ * Copy the current serving paths (empty string when unset)
+ * Each request works on its own copy so a reload can't change paths mid-response.
+ */
+void get_serving_paths(char *directory, size_t dir_len, char *single_file, size_t file_len) {
+    pthread_rwlock_rdlock(&g_config_lock);
+    snprintf(directory, dir_len, "%s", g_directory ? g_directory : "");
+    snprintf(single_file, file_len, "%s", g_single_file ? g_single_file : "");
+    pthread_rwlock_unlock(&g_config_lock);
+}
+
 int ends_with(char *input, char *extension) {
     if (input == NULL || extension == NULL)
         return 0;
@@ -61,149 +369,457 @@ int ends_with(char *input, char *extension) {
     return 1;
 }
 
-void serve_file(int client_fd, const char *filepath) {
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        fprintf(stderr, "File not found: %s\n", filepath);
-        send_error_response(client_fd, 404,0);
-        return;
-    }
-
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+/**
+ * Send a whole, already open file with Content-Length (small files; see stream_file)
+ * @param st         - fstat() of fd; exactly st_size bytes are sent
+ * @param bytes_sent - Body bytes sent
+ * @return HTTP status sent
+ */
+int serve_file(int client_fd, const char *filepath, int fd, const struct stat *st,
+               int keep_alive, size_t *bytes_sent) {
+    size_t size = (size_t)st->st_size;
+    *bytes_sent = 0;
 
     // Check for empty file
     if (size == 0) {
-        fclose(fp);
-        send_success_response(client_fd, NULL, get_content_type(filepath), 0);
-        return;
+        send_response(client_fd, 200, get_content_type(filepath), NULL, 0, keep_alive, st);
+        return 200;
     }
 
     // Allocate buffer
     char *buffer = malloc(size);
     if (!buffer) {
         fprintf(stderr, "malloc failed for file buffer\n");
-        fclose(fp);
-        send_error_response(client_fd, 500,0);
-        return;
+        send_error_response(client_fd, 500, 0);
+        return 500;
     }
 
     // Read file
-    size_t bytes_read = fread(buffer, 1, size, fp);
-    fclose(fp);
+    size_t bytes_read = 0;
+    while (bytes_read < size) {
+        ssize_t n = read(fd, buffer + bytes_read, size - bytes_read);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+        bytes_read += (size_t)n;
+    }
 
-    if (bytes_read != (size_t)size) {
+    if (bytes_read != size) {
         fprintf(stderr, "Failed to read file completely\n");
         free(buffer);
-        send_error_response(client_fd, 500,0);
-        return;
+        send_error_response(client_fd, 500, 0);
+        return 500;
     }
 
     // Send response
-    char *content_type = get_content_type(filepath);
-    send_success_response(client_fd, buffer, content_type, size);
+    if (send_response(client_fd, 200, get_content_type(filepath), buffer, size, keep_alive, st))
+        *bytes_sent = size;
 
     free(buffer);
+    return 200;
 }
 
-char *get_content_type(const char *filename) {
-    if (ends_with((char *)filename, ".html") || ends_with((char *)filename, ".htm")) {
-        return "text/html";
-    } else if (ends_with((char *)filename, ".css")) {
-        return "text/css";
-    } else if (ends_with((char *)filename, ".js")) {
-        return "text/javascript";
-    } else if (ends_with((char *)filename, ".json")) {
-        return "application/json";
-    } else if (ends_with((char *)filename, ".png")) {
-        return "image/png";
-    } else if (ends_with((char *)filename, ".jpg") || ends_with((char *)filename, ".jpeg")) {
-        return "image/jpeg";
-    } else if (ends_with((char *)filename, ".gif")) {
-        return "image/gif";
-    } else if (ends_with((char *)filename, ".svg")) {
-        return "image/svg+xml";
-    } else if (ends_with((char *)filename, ".txt")) {
-        return "text/plain";
-    } else {
-        return "application/octet-stream";
+/**
+ * Send a whole buffer, waiting for the socket to drain when it is full
+ * A client that stops reading for SEND_TIMEOUT_MS is given up on.
+ * @return 1 on success, 0 on error or timeout
+ */
+int send_all(int client_fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t sent = send(client_fd, buf, len, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (sent > 0) {
+            buf += sent;
+            len -= (size_t)sent;
+            continue;
+        }
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            struct pollfd pfd = { .fd = client_fd, .events = POLLOUT };
+            if (poll(&pfd, 1, SEND_TIMEOUT_MS) > 0)
+                continue;
+        }
+        return 0;
     }
+    return 1;
 }
 
+/**
+ * Start a chunked response: sends the status line and headers
+ * @return 1 on success, 0 if the headers could not be sent
+ */
+int chunk_stream_begin(chunk_stream *stream, int client_fd, const char *content_type, int keep_alive) {
+    stream->client_fd = client_fd;
+    stream->used = 0;
+    stream->bytes_sent = 0;
+    stream->failed = 0;
 
-void serve_file_keepalive(int client_fd, const char *filepath, int keep_alive) {
-    FILE *fp = fopen(filepath, "rb");
-    if (!fp) {
-        fprintf(stderr, "File not found: %s\n", filepath);
-        send_error_response(client_fd, 404, keep_alive);
-        return;
+    if (content_type == NULL)
+        content_type = "application/octet-stream";
+
+    char hdr[RESPONSE_HEADER_MAX];
+    size_t len = build_response_header(hdr, 200, content_type, keep_alive, -1, NULL);
+
+    if (!send_all(client_fd, hdr, len)) {
+        printf("error in sending: %s\n", strerror(errno));
+        stream->failed = 1;
+        return 0;
     }
+    trace_mark(TRACE_HEADERS_SENT);
+    return 1;
+}
+
+/**
+ * Frame the buffered data as one chunk and send it with a single send()
+ */
+static int chunk_stream_flush(chunk_stream *stream) {
+    if (stream->failed)
+        return 0;
+    if (stream->used == 0)
+        return 1;
 
-    // Get file size
-    fseek(fp, 0, SEEK_END);
-    long size = ftell(fp);
-    fseek(fp, 0, SEEK_SET);
+    // Hex size is written right-aligned just before the data
+    char *start = g_chunk_buf + CHUNK_PREFIX_LEN - 2;
+    start[0] = '\r';
+    start[1] = '\n';
+    start = format_uint(start, stream->used, 16);
 
-    // Check for empty file
-    if (size == 0) {
-        fclose(fp);
-        send_success_response_keepalive(client_fd, NULL, get_content_type(filepath), 0, keep_alive);
-        return;
+    char *end = g_chunk_buf + CHUNK_PREFIX_LEN + stream->used;
+    end[0] = '\r';
+    end[1] = '\n';
+
+    if (!send_all(stream->client_fd, start, (size_t)(end + 2 - start))) {
+        stream->failed = 1;
+        return 0;
     }
+    stream->bytes_sent += stream->used;
+    stream->used = 0;
+    return 1;
+}
 
-    // Allocate buffer
-    char *buffer = malloc(size);
-    if (!buffer) {
-        fprintf(stderr, "malloc failed for file buffer\n");
-        fclose(fp);
-        send_error_response(client_fd, 500, 0);
-        return;
+/**
+ * Append body data, sending a chunk each time the buffer fills up
+ * @return 1 on success, 0 once the client is gone
+ */
+int chunk_stream_write(chunk_stream *stream, const char *data, size_t len) {
+    while (len > 0 && !stream->failed) {
+        size_t room = STREAM_CHUNK_SIZE - stream->used;
+        size_t n = len < room ? len : room;
+        memcpy(g_chunk_buf + CHUNK_PREFIX_LEN + stream->used, data, n);
+        stream->used += n;
+        data += n;
+        len -= n;
+        if (stream->used == STREAM_CHUNK_SIZE)
+            chunk_stream_flush(stream);
     }
+    return !stream->failed;
+}
 
-    // Read file
-    size_t bytes_read = fread(buffer, 1, size, fp);
-    fclose(fp);
+/**
+ * Send any buffered data and the terminating zero-length chunk
+ * @return 1 on success, 0 if the response was cut short
+ */
+int chunk_stream_end(chunk_stream *stream) {
+    if (!chunk_stream_flush(stream))
+        return 0;
+    if (!send_all(stream->client_fd, "0\r\n\r\n", 5)) {
+        stream->failed = 1;
+        return 0;
+    }
+    trace_mark(TRACE_BODY_SENT);
+    return 1;
+}
 
-    if (bytes_read != (size_t)size) {
-        fprintf(stderr, "Failed to read file completely\n");
-        free(buffer);
-        send_error_response(client_fd, 500, 0);
-        return;
+/**
+ * Check whether the client hung up (used while waiting for a file to grow)
+ */
+static int client_gone(int client_fd) {
+    struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+    if (poll(&pfd, 1, 0) <= 0)
+        return 0;
+    if (pfd.revents & (POLLHUP | POLLERR))
+        return 1;
+    char c;
+    return recv(client_fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+/**
+ * Send the first length bytes of an open file from the fixed per-thread buffer
+ * @return number of body bytes sent; less than length if the file shrank
+ * or the client went away
+ */
+static size_t send_file_range(int client_fd, int fd, size_t length) {
+    size_t sent = 0;
+    while (sent < length) {
+        size_t want = length - sent < STREAM_CHUNK_SIZE ? length - sent : STREAM_CHUNK_SIZE;
+        ssize_t n = read(fd, g_chunk_buf, want);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            if (n < 0)
+                fprintf(stderr, "Failed to read file: %s\n", strerror(errno));
+            break;
+        }
+        if (!send_all(client_fd, g_chunk_buf, (size_t)n))
+            break;
+        sent += (size_t)n;
     }
+    return sent;
+}
 
-    // Send response
-    char *content_type = get_content_type(filepath);
-    send_success_response_keepalive(client_fd, buffer, content_type, size, keep_alive);
+/**
+ * Serve an already open file from the fixed per-thread buffer, never
+ * loading it whole
+ * The first bytes go out as soon as they are read, whatever the file size.
+ * Without follow the response has a Content-Length (and ETag) from st and
+ * covers the file as it was when opened. With follow it is a chunked
+ * stream that keeps sending new data as the file grows (like tail -f)
+ * until it has been idle for FOLLOW_IDLE_MS or the server is draining.
+ *
+ * @param bytes_sent - Body bytes sent
+ * @return HTTP status sent
+ */
+int stream_file(int client_fd, const char *filepath, int fd, const struct stat *st,
+                int keep_alive, int follow, size_t *bytes_sent) {
+    *bytes_sent = 0;
 
-    free(buffer);
+    if (!follow) {
+        char hdr[RESPONSE_HEADER_MAX];
+        size_t len = build_response_header(hdr, 200, get_content_type(filepath), keep_alive,
+                                           (long long)st->st_size, st);
+        if (!send_all(client_fd, hdr, len)) {
+            printf("error in sending: %s\n", strerror(errno));
+            shutdown(client_fd, SHUT_RDWR);
+            return 200;
+        }
+        trace_mark(TRACE_HEADERS_SENT);
+
+        *bytes_sent = send_file_range(client_fd, fd, (size_t)st->st_size);
+        if (*bytes_sent < (size_t)st->st_size) {
+            // The promised length can't be met; make the keep-alive loop drop the connection
+            shutdown(client_fd, SHUT_RDWR);
+        } else {
+            trace_mark(TRACE_BODY_SENT);
+        }
+        return 200;
+    }
+
+    chunk_stream stream;
+    if (!chunk_stream_begin(&stream, client_fd, get_content_type(filepath), keep_alive))
+        return 200;
+
+    int idle_ms = 0;
+    while (!stream.failed) {
+        // Read straight into the chunk buffer, no intermediate copy
+        ssize_t n = read(fd, g_chunk_buf + CHUNK_PREFIX_LEN + stream.used,
+                         STREAM_CHUNK_SIZE - stream.used);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "Failed to read file: %s\n", strerror(errno));
+            stream.failed = 1;
+            break;
+        }
+
+        if (n > 0) {
+            idle_ms = 0;
+            stream.used += (size_t)n;
+            if (stream.used == STREAM_CHUNK_SIZE)
+                chunk_stream_flush(&stream);
+            continue;
+        }
+
+        // At the current end of file: wait for it to grow
+        chunk_stream_flush(&stream);
+        if (idle_ms >= FOLLOW_IDLE_MS || g_draining || client_gone(client_fd))
+            break;
+
+        struct timespec tick = { .tv_sec = 0, .tv_nsec = FOLLOW_POLL_MS * 1000000L };
+        nanosleep(&tick, NULL);
+        idle_ms += FOLLOW_POLL_MS;
+    }
+
+    if (stream.failed || !chunk_stream_end(&stream)) {
+        // The body is incomplete; make the keep-alive loop drop the connection
+        shutdown(client_fd, SHUT_RDWR);
+    }
+    *bytes_sent = stream.bytes_sent;
+    return 200;
+}
+
+/**
+ * Cut the query string off a request path
+ * @return the query (without '?'), or an empty string if there is none
+ */
+static char *split_query(char *path) {
+    char *query = strchr(path, '?');
+    if (!query)
+        return path + strlen(path);
+    *query = '\0';
+    return query + 1;
+}
+
+/**
+ * Look up a query parameter ("name" or "name=value")
+ * @param value - Receives the value (may be NULL if only presence matters)
+ * @return 1 if the parameter is present
+ */
+static int query_param(const char *query, const char *name, char *value, size_t value_len) {
+    size_t name_len = strlen(name);
+    while (*query) {
+        size_t len = strcspn(query, "&");
+        if (strncmp(query, name, name_len) == 0 &&
+            (len == name_len || query[name_len] == '=')) {
+            if (value && value_len > 0) {
+                size_t val_len = len > name_len ? len - name_len - 1 : 0;
+                if (val_len >= value_len)
+                    val_len = value_len - 1;
+                memcpy(value, query + name_len + 1, val_len);
+                value[val_len] = '\0';
+            }
+            return 1;
+        }
+        query += len;
+        if (*query == '&')
+            query++;
+    }
+    return 0;
+}
+
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/**
+ * Decode %XX escapes in a request path, in place
+ * @return 1 on success, 0 for malformed escapes or an encoded NUL
+ */
+static int url_decode_path(char *path) {
+    char *out = path;
+    for (char *in = path; *in; in++) {
+        if (*in != '%') {
+            *out++ = *in;
+            continue;
+        }
+        int hi = hex_value(in[1]);
+        int lo = hi < 0 ? -1 : hex_value(in[2]);
+        if (lo < 0 || (hi == 0 && lo == 0))
+            return 0;
+        *out++ = (char)(hi * 16 + lo);
+        in += 2;
+    }
+    *out = '\0';
+    return 1;
+}
+
+/**
+ * Decide between a fixed Content-Length response and a chunked stream
+ * Chunked needs HTTP/1.1; it is used for followed files and large ones,
+ * so they are never loaded into memory whole.
+ */
+static int use_streaming(const http_request *request, size_t file_size, int *follow) {
+    if (*follow && strcmp(request->version, "HTTP/1.1") != 0)
+        *follow = 0;
+    return *follow || file_size > STREAM_THRESHOLD;
+}
+
+/**
+ * Open a file once and answer with it
+ * The size that picks between serve_file() and stream_file() comes from
+ * fstat() on the same descriptor they read, so the file can't change in between.
+ * @param bytes_sent - Body bytes sent
+ * @return HTTP status sent
+ */
+static int send_file(int client_fd, const char *filepath, const http_request *request,
+                     int keep_alive, int follow, size_t *bytes_sent) {
+    *bytes_sent = 0;
+
+    int fd = open(filepath, O_RDONLY | O_CLOEXEC);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        fprintf(stderr, "File not found: %s\n", filepath);
+        if (fd >= 0)
+            close(fd);
+        send_error_response(client_fd, 404, keep_alive);
+        return 404;
+    }
+    trace_mark(TRACE_OPENED);
+
+    int status;
+    if (use_streaming(request, (size_t)st.st_size, &follow))
+        status = stream_file(client_fd, filepath, fd, &st, keep_alive, follow, bytes_sent);
+    else
+        status = serve_file(client_fd, filepath, fd, &st, keep_alive, bytes_sent);
+    close(fd);
+    return status;
+}
+
+/**
+ * Wait until the client sends data
+ * While draining, idle keep-alive connections (after the first request)
+ * are given up on straight away instead of waiting out the timeout.
+ *
+ * @return 1 if data is ready, 0 on timeout, -1 if closed for drain
+ */
+static int wait_for_request(int client_fd, int request_count) {
+    for (int waited = 0; waited < KEEPALIVE_TIMEOUT_MS; waited += DRAIN_POLL_MS) {
+        if (g_draining && request_count > 0)
+            return -1;
+
+        struct pollfd pfd = { .fd = client_fd, .events = POLLIN };
+        int ready = poll(&pfd, 1, DRAIN_POLL_MS);
+        if (ready > 0 || (ready < 0 && errno != EINTR))
+            return 1;  // let recv() report data, EOF or the error
+    }
+    return 0;
 }
 
 void *handel_client(void *arg) {
-    int client_fd = *((int*)arg);
+    client_conn conn = *(client_conn *)arg;
+    int client_fd = conn.fd;
+    uint64_t client_key = conn.key;
     free(arg);
     
     // Get client IP address
-    struct sockaddr_in addr;
+    struct sockaddr_storage addr;
     socklen_t addr_size = sizeof(addr);
-    char client_ip[INET_ADDRSTRLEN] = "unknown";
+    char client_ip[INET6_ADDRSTRLEN] = "unknown";
     
-    if (getpeername(client_fd, (struct sockaddr *)&addr, &addr_size) == 0) {
-        inet_ntop(AF_INET, &addr.sin_addr, client_ip, sizeof(client_ip));
-    }
+    if (getpeername(client_fd, (struct sockaddr *)&addr, &addr_size) == 0)
+        format_peer_addr(&addr, client_ip, sizeof(client_ip));
+
+    trace_thread_attach();
     
     // Set socket timeout (5 seconds)
     struct timeval tv;
     tv.tv_sec = 5;
     tv.tv_usec = 0;
     setsockopt(client_fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    // Also bounds blocking sends and proxy splices to a client that stops reading
+    setsockopt(client_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    apply_connection_options(client_fd, &g_socket_options);
     
     int request_count = 0;
     int keep_alive = 1;
     
     // Keep connection alive for multiple requests
     while (keep_alive) {
+        // Flush the tail of the previous response (push=cork)
+        set_cork(client_fd, 0);
+
+        int ready = wait_for_request(client_fd, request_count);
+        if (ready <= 0) {
+            log_message(LOG_INFO, "Client %s %s after %d requests", client_ip,
+                        ready < 0 ? "closed for shutdown" : "timeout", request_count);
+            break;
+        }
+
+        trace_begin();
+
         char req[4096] = {0};
         ssize_t recv_rq = recv(client_fd, req, sizeof(req) - 1, 0);
      
@@ -221,8 +837,19 @@ void *handel_client(void *arg) {
         }
         
         request_count++;
+        trace_mark(TRACE_RECV);
         
-        http_request request_data = parse_http_request(req);
+        http_request request_data = parse_http_request(req, (size_t)recv_rq);
+        trace_mark(TRACE_PARSED);
+        set_cork(client_fd, 1);
+
+        // Per-client request rate limit
+        if (!rl_allow_request(client_key)) {
+            send_error_response(client_fd, 429, 0);
+            log_request(client_ip, request_data.valid ? request_data.method : "-",
+                        request_data.valid ? request_data.path : "-", 429, 0);
+            break;
+        }
         
         if (!request_data.valid) {
             send_error_response(client_fd, 400, 0);  // Don't keep alive on error
@@ -243,6 +870,35 @@ void *handel_client(void *arg) {
             keep_alive = 0;  // Force close after 100 requests
         }
 
+        // Shutting down: answer this request, then close the connection
+        if (g_draining) {
+            keep_alive = 0;
+        }
+
+        // Upstream routes take precedence over files, for any method
+        upstream_route *route = proxy_match(request_data.path);
+        if (route) {
+            size_t bytes_sent = 0;
+            int status_code = proxy_forward(client_fd, route, req, (size_t)recv_rq, &request_data,
+                                            client_ip, &keep_alive, &bytes_sent);
+            log_request(client_ip, request_data.method, request_data.path, status_code, bytes_sent);
+            continue;
+        }
+
+        // "?follow" streams a growing file, "?format=json" picks JSON listings
+        char *query = split_query(request_data.path);
+        if (!url_decode_path(request_data.path)) {
+            send_error_response(client_fd, 400, 0);
+            log_request(client_ip, request_data.method, request_data.path, 400, 0);
+            break;
+        }
+        int follow = query_param(query, "follow", NULL, 0);
+
+        // Snapshot paths so a concurrent reload can't change them mid-request
+        char directory[256];
+        char single_file[256];
+        get_serving_paths(directory, sizeof(directory), single_file, sizeof(single_file));
+
         // Only handle GET requests
         if (strcmp(request_data.method, "GET") != 0) {
             send_error_response(client_fd, 405, 0);
@@ -251,27 +907,21 @@ void *handel_client(void *arg) {
         }
 
         // Single file mode
-        if (g_single_file) {
-            char *expected_filename = strrchr(g_single_file, '/');
+        if (single_file[0]) {
+            char *expected_filename = strrchr(single_file, '/');
             if (expected_filename) {
                 expected_filename++;
             } else {
-                expected_filename = g_single_file;
+                expected_filename = single_file;
             }
             
             char expected_path[512];
             snprintf(expected_path, sizeof(expected_path), "/%s", expected_filename);
             
             if (strcmp(request_data.path, expected_path) == 0) {
-                FILE *fp = fopen(g_single_file, "rb");
-                long size = 0;
-                if (fp) {
-                    fseek(fp, 0, SEEK_END);
-                    size = ftell(fp);
-                    fclose(fp);
-                }
-                serve_file_keepalive(client_fd, g_single_file, keep_alive);
-                log_request(client_ip, request_data.method, request_data.path, 200, size);
+                size_t size;
+                int status = send_file(client_fd, single_file, &request_data, keep_alive, follow, &size);
+                log_request(client_ip, request_data.method, request_data.path, status, size);
             } else {
                 send_error_response(client_fd, 404, keep_alive);
                 log_request(client_ip, request_data.method, request_data.path, 404, 0);
@@ -280,50 +930,64 @@ void *handel_client(void *arg) {
         }
 
         // Directory mode
-        if (g_directory) {
+        if (directory[0]) {
             int status_code = 200;
             size_t bytes_sent = 0;
-            
-            if (strcmp(request_data.path, "/") == 0) {
-                char index_path[512];
-                snprintf(index_path, sizeof(index_path), "%s/index.html", g_directory);
-                
-                FILE *fp = fopen(index_path, "rb");
-                if (fp) {
-                    fseek(fp, 0, SEEK_END);
-                    bytes_sent = ftell(fp);
-                    fclose(fp);
-                    serve_file_keepalive(client_fd, index_path, keep_alive);
-                } else {
-                    status_code = 404;
-                    send_error_response(client_fd, 404, keep_alive);
-                }
-                log_request(client_ip, request_data.method, request_data.path, status_code, bytes_sent);
-            } else {
-                char *requested_path = request_data.path + 1;
-                
-                if (strstr(requested_path, "..") != NULL) {
-                    send_error_response(client_fd, 403, 0);
-                    log_request(client_ip, request_data.method, request_data.path, 403, 0);
-                    break;
-                }
+            char *requested_path = request_data.path + 1;
+
+            if (strstr(requested_path, "..") != NULL) {
+                send_error_response(client_fd, 403, 0);
+                log_request(client_ip, request_data.method, request_data.path, 403, 0);
+                break;
+            }
+
+            char full_path[512];
+            if (snprintf(full_path, sizeof(full_path), "%s/%s", directory, requested_path) >=
+                (int)sizeof(full_path)) {
+                send_error_response(client_fd, 404, keep_alive);
+                log_request(client_ip, request_data.method, request_data.path, 404, 0);
+                continue;
+            }
+
+            // Directories serve their index.html, or a listing when enabled
+            char index_path[sizeof(full_path) + 16];
+            char *serve_path = full_path;
+            struct stat st;
+            if (stat(full_path, &st) == 0 && S_ISDIR(st.st_mode)) {
+                snprintf(index_path, sizeof(index_path), "%s/index.html", full_path);
 
-                char full_path[512];
-                snprintf(full_path, sizeof(full_path), "%s/%s", g_directory, requested_path);
-                
-                FILE *fp = fopen(full_path, "rb");
-                if (fp) {
-                    fseek(fp, 0, SEEK_END);
-                    bytes_sent = ftell(fp);
-                    fclose(fp);
-                    serve_file_keepalive(client_fd, full_path, keep_alive);
-                    status_code = 200;
+                if (access(index_path, R_OK) == 0) {
+                    serve_path = index_path;
+                } else if (autoindex_enabled()) {
+                    // Links in the listing are relative to a path ending in '/'
+                    char url_path[512];
+                    size_t path_len = strlen(request_data.path);
+                    snprintf(url_path, sizeof(url_path), "%s%s", request_data.path,
+                             path_len > 0 && request_data.path[path_len - 1] == '/' ? "" : "/");
+
+                    char format[16] = {0};
+                    char accept[128] = {0};
+                    query_param(query, "format", format, sizeof(format));
+                    get_header_value(req, "Accept", accept, sizeof(accept));
+                    int json = strcmp(format, "json") == 0 ||
+                               (!format[0] && strstr(accept, "application/json") != NULL);
+
+                    status_code = serve_directory_listing(client_fd, full_path, url_path, json,
+                                                          keep_alive,
+                                                          strcmp(request_data.version, "HTTP/1.1") == 0,
+                                                          &bytes_sent);
+                    log_request(client_ip, request_data.method, request_data.path, status_code, bytes_sent);
+                    continue;
                 } else {
                     send_error_response(client_fd, 404, keep_alive);
-                    status_code = 404;
+                    log_request(client_ip, request_data.method, request_data.path, 404, 0);
+                    continue;
                 }
-                log_request(client_ip, request_data.method, request_data.path, status_code, bytes_sent);
             }
+
+            status_code = send_file(client_fd, serve_path, &request_data, keep_alive, follow,
+                                    &bytes_sent);
+            log_request(client_ip, request_data.method, request_data.path, status_code, bytes_sent);
             continue;
         }
 
@@ -332,160 +996,196 @@ void *handel_client(void *arg) {
         break;
     }
     
+    trace_thread_detach();
+    proxy_thread_cleanup();
     close(client_fd);
+    rl_release_connection(conn.rl_slot);
+    atomic_fetch_sub(&g_active_connections, 1);
     return NULL;
 }
 
-int send_error_response(int client_fd, int code, int keep_alive) {
-    char *reason;
-    switch (code) {
-        case 400: reason = "Bad Request"; break;
-        case 401: reason = "Unauthorized"; break;
-        case 403: reason = "Forbidden"; break;
-        case 404: reason = "Not Found"; break;
-        case 405: reason = "Method Not Allowed"; break;
-        case 408: reason = "Request Timeout"; break;
-        default:  reason = "Internal Server Error"; code = 500; break;
-    }
-    
-    char hdr[256];
-    const char *connection = keep_alive ? "keep-alive" : "close";
-    
-    snprintf(hdr, sizeof(hdr), 
-             "HTTP/1.1 %d %s\r\n"
-             "Content-Length: 0\r\n"
-             "Connection: %s\r\n"
-             "\r\n", 
-             code, reason, connection);
-    
-    if (send(client_fd, hdr, strlen(hdr), 0) < 0) {
-        printf("error in sending : %s \n", strerror(errno));
-        return 0;
-    }
-    return 1;
-}
+/**
+ * One "Name: value" line of the header block
+ */
+typedef struct header_line {
+    const char *name;
+    size_t name_len;
+    const char *value;
+    size_t value_len;
+} header_line;
 
-int send_success_response(int client_fd, char *body, char *content_type, size_t content_length) {
-    char hdr[512];
-    
-    if (body == NULL) {
-        snprintf(hdr, sizeof(hdr), "HTTP/1.1 200 OK\r\nContent-Length: 0\r\nConnection: close\r\n\r\n");
-        if (send(client_fd, hdr, strlen(hdr), 0) < 0) {
-            printf("error in sending: %s\n", strerror(errno));
-            return 0;
-        }
-        return 1;
-    } else {
-        if (content_type == NULL)
-            content_type = "application/octet-stream";
-    
-        snprintf(hdr, sizeof(hdr), 
-                 "HTTP/1.1 200 OK\r\nContent-Type: %s\r\nContent-Length: %zu\r\n\r\n",
-                 content_type, content_length);
-                 
-        if (send(client_fd, hdr, strlen(hdr), 0) < 0 || 
-            send(client_fd, body, content_length, 0) < 0) {
-            printf("error in sending: %s\n", strerror(errno));
-            return 0;
-        }
-    }   
+/**
+ * Step to the next header line
+ * Stops at the blank line ending the headers, so body bytes are never
+ * matched. Lines without a ':' are skipped; leading and trailing blanks
+ * are trimmed from the value.
+ * @param cursor - Start of a header line; advanced past it
+ * @return 1 if a header was found, 0 at the end of the headers
+ */
+static int next_header(const char **cursor, header_line *h) {
+    const char *line = *cursor;
+    for (;;) {
+        const char *eol = strchr(line, '\n');
+        if (!eol)
+            return 0;  // incomplete line
+        const char *end = (eol > line && eol[-1] == '\r') ? eol - 1 : eol;
+        if (end == line)
+            return 0;  // blank line: end of headers
 
-    return 1;
-}
+        const char *colon = memchr(line, ':', (size_t)(end - line));
+        if (colon && colon > line) {
+            const char *value = colon + 1;
+            while (value < end && (*value == ' ' || *value == '\t')) value++;
+            while (end > value && (end[-1] == ' ' || end[-1] == '\t')) end--;
 
-int send_success_response_keepalive(int client_fd, char *body, char *content_type, 
-                                    size_t content_length, int keep_alive) {
-    char hdr[512];
-    const char *connection = keep_alive ? "keep-alive" : "close";
-    
-    if (body == NULL) {
-        snprintf(hdr, sizeof(hdr), 
-                 "HTTP/1.1 200 OK\r\n"
-                 "Content-Length: 0\r\n"
-                 "Connection: %s\r\n"
-                 "\r\n", 
-                 connection);
-        if (send(client_fd, hdr, strlen(hdr), 0) < 0) {
-            printf("error in sending: %s\n", strerror(errno));
-            return 0;
+            h->name = line;
+            h->name_len = (size_t)(colon - line);
+            h->value = value;
+            h->value_len = (size_t)(end - value);
+            *cursor = eol + 1;
+            return 1;
         }
-        return 1;
-    } else {
-        if (content_type == NULL)
-            content_type = "application/octet-stream";
-    
-        snprintf(hdr, sizeof(hdr), 
-                 "HTTP/1.1 200 OK\r\n"
-                 "Content-Type: %s\r\n"
-                 "Content-Length: %zu\r\n"
-                 "Connection: %s\r\n"
-                 "Keep-Alive: timeout=5, max=100\r\n"
-                 "\r\n",
-                 content_type, content_length, connection);
-                 
-        if (send(client_fd, hdr, strlen(hdr), 0) < 0 || 
-            send(client_fd, body, content_length, 0) < 0) {
-            printf("error in sending: %s\n", strerror(errno));
-            return 0;
-        }
-    }   
+        line = eol + 1;
+    }
+}
 
-    return 1;
+static int header_is(const header_line *h, const char *name, size_t name_len) {
+    return h->name_len == name_len && strncasecmp(h->name, name, name_len) == 0;
+}
+
+/**
+ * Copy a header value, truncating it to fit out_len
+ */
+static void copy_value(const header_line *h, char *out_value, size_t out_len) {
+    size_t len = h->value_len < out_len - 1 ? h->value_len : out_len - 1;
+    memcpy(out_value, h->value, len);
+    out_value[len] = '\0';
 }
 
+/**
+ * Find a header by name (case-insensitive) in a raw request
+ * @return 1 and the (possibly truncated) value in out_value, 0 if absent
+ */
 int get_header_value(char req[], const char *header_name, char *out_value, size_t out_len) {
-    if (!req || !header_name || !out_value) 
+    if (!req || !header_name || !out_value || out_len == 0)
         return 0;
 
-    char search_arr[128] = {0};
-    snprintf(search_arr, sizeof(search_arr), "%s: ", header_name);
-
-    // find the start of the string
-    char *start_value = strstr(req, search_arr);
-
-    if (!start_value) return 0;
-    
-    start_value += strlen(search_arr);
-
-    // find the end of the string 
-    char *end_value = strstr(start_value, "\r\n");
+    // Headers start after the request line
+    const char *cursor = strchr(req, '\n');
+    if (!cursor)
+        return 0;
+    cursor++;
 
-    if (!end_value) return 0;
+    size_t name_len = strlen(header_name);
+    header_line h;
+    while (next_header(&cursor, &h)) {
+        if (header_is(&h, header_name, name_len)) {
+            copy_value(&h, out_value, out_len);
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    // calc the length and copy it
-    ssize_t in_len = end_value - start_value;   
-        
-    if (in_len >= (ssize_t)out_len) in_len = out_len - 1; 
-        
-    strncpy(out_value, start_value, in_len);
-    out_value[in_len] = '\0';
+/**
+ * Copy one request-line token ending at a delimiter
+ * @return pointer to the delimiter, or NULL if the token is empty, too
+ * long for out, or contains control characters
+ */
+static const char *copy_token(const char *p, char delim, char *out, size_t out_len) {
+    size_t len = 0;
+    while (p[len] != delim) {
+        if ((unsigned char)p[len] <= ' ' || p[len] == 0x7f)
+            return NULL;
+        len++;
+    }
+    if (len == 0 || len >= out_len)
+        return NULL;
+    memcpy(out, p, len);
+    out[len] = '\0';
+    return p + len;
+}
 
-    return 1;
+/**
+ * Length of the header block: up to the blank line ending it, or all of
+ * len if it hasn't arrived
+ */
+static size_t header_block_len(const char *req, size_t len) {
+    const char *end = req + len;
+    for (const char *lf = req; (lf = memchr(lf, '\n', (size_t)(end - lf))) != NULL; ) {
+        lf++;
+        if (lf < end && *lf == '\n')
+            return (size_t)(lf - req);
+        if (end - lf >= 2 && lf[0] == '\r' && lf[1] == '\n')
+            return (size_t)(lf - req);
+    }
+    return len;
 }
 
-http_request parse_http_request(char req[]) {
+/**
+ * Parse the request line and the headers the server uses, in one pass
+ * The request line must be "METHOD SP target SP HTTP/x.y CRLF" with a
+ * target starting with '/'; tokens that don't fit their field make the
+ * request invalid rather than being truncated into a different path.
+ * @param len - Bytes received; a NUL in the header block is invalid
+ */
+http_request parse_http_request(char req[], size_t len) {
     http_request parsed = {0};
     parsed.content_type = NULL;
-    parsed.valid = 1;
+    parsed.valid = 0;
     
-    if (req == NULL) {
-        parsed.valid = 0;
+    if (req == NULL)
         return parsed;
-    }
 
-    if (sscanf(req, "%15s %255s %15s", parsed.method, parsed.path, parsed.version) != 3) {
-        printf("parsing request failed : %s\n", strerror(errno));
-        parsed.valid = 0;
+    // The scans below stop at a NUL, which would hide the rest of the headers
+    if (memchr(req, '\0', header_block_len(req, len)))
+        return parsed;
+
+    const char *eol = strchr(req, '\n');
+    if (!eol)
+        return parsed;
+    const char *line_end = (eol > req && eol[-1] == '\r') ? eol - 1 : eol;
+
+    const char *p = copy_token(req, ' ', parsed.method, sizeof(parsed.method));
+    if (p)
+        p = copy_token(p + 1, ' ', parsed.path, sizeof(parsed.path));
+    if (!p || parsed.path[0] != '/')
         return parsed;
-    }
-    
-    get_header_value(req, "User-Agent", parsed.user_agent, sizeof(parsed.user_agent));
-    get_header_value(req, "Host", parsed.host, sizeof(parsed.host));
 
-    char content_length[32] = {0};
-    if (get_header_value(req, "Content-Length", content_length, sizeof(content_length)))
-        parsed.content_length = atoi(content_length);
+    // The version runs to the end of the line
+    size_t version_len = (size_t)(line_end - (p + 1));
+    if (line_end < p + 1 || version_len >= sizeof(parsed.version) ||
+        strncmp(p + 1, "HTTP/", 5) != 0 || version_len <= 5)
+        return parsed;
+    memcpy(parsed.version, p + 1, version_len);
+    parsed.version[version_len] = '\0';
 
+    const char *cursor = eol + 1;
+    int have_length = 0;
+    header_line h;
+    while (next_header(&cursor, &h)) {
+        if (header_is(&h, "User-Agent", 10)) {
+            copy_value(&h, parsed.user_agent, sizeof(parsed.user_agent));
+        } else if (header_is(&h, "Host", 4)) {
+            copy_value(&h, parsed.host, sizeof(parsed.host));
+        } else if (header_is(&h, "Content-Length", 14)) {
+            // Digits only, and repeated headers must agree
+            long long length = 0;
+            if (h.value_len == 0 || h.value_len > 10)
+                return parsed;
+            for (size_t i = 0; i < h.value_len; i++) {
+                if (h.value[i] < '0' || h.value[i] > '9')
+                    return parsed;
+                length = length * 10 + (h.value[i] - '0');
+            }
+            if (length > INT_MAX || (have_length && length != parsed.content_length))
+                return parsed;
+            parsed.content_length = (int)length;
+            have_length = 1;
+        }
+    }
+
+    parsed.valid = 1;
     return parsed;
 }
 
@@ -522,7 +1222,7 @@ char *remove_first_n_copy(const char *s, size_t n) {
 
 void init_logging(const char *log_file) {
     if (log_file) {
-        g_log_file = fopen(log_file, "a");  // Append mode
+        g_log_file = fopen(log_file, "ae");  // Append mode, not inherited on exec
         if (!g_log_file) {
             fprintf(stderr, "Warning: Could not open log file '%s': %s\n", 
                     log_file, strerror(errno));
@@ -543,6 +1243,32 @@ void close_logging(void) {
     }
 }
 
+/**
+ * Reopen the log file, e.g. after logrotate moved it away
+ * Requests logged concurrently go to either the old or the new file, never lost.
+ * @param log_file - Path to log file, or NULL for stdout only
+ */
+void reopen_logging(const char *log_file) {
+    FILE *new_file = NULL;
+    if (log_file) {
+        new_file = fopen(log_file, "ae");
+        if (!new_file) {
+            log_message(LOG_ERROR, "Could not reopen log file '%s': %s",
+                        log_file, strerror(errno));
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&g_log_mutex);
+    FILE *old_file = g_log_file;
+    g_log_file = new_file;
+    pthread_mutex_unlock(&g_log_mutex);
+
+    if (old_file)
+        fclose(old_file);
+    log_message(LOG_INFO, "Log file reopened");
+}
+
 /**
  * Get current timestamp string
  */
@@ -599,6 +1325,9 @@ void log_message(log_level level, const char *format, ...) {
  */
 void log_request(const char *client_ip, const char *method, const char *path, 
                  int status_code, size_t bytes_sent) {
+    // Every request ends with exactly one log line: close its trace record here
+    trace_end(status_code, bytes_sent);
+
     char timestamp[64];
     time_t now = time(NULL);
     struct tm *tm_info = localtime(&now);
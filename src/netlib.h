@@ -1,6 +1,9 @@
 #ifndef NETLIB_H
 #define NETLIB_H
 #include "stddef.h"
+#include <stdint.h>
+#include <sys/socket.h>
+#include "response.h"
 
 typedef struct http_request {
     char method[16];
@@ -13,6 +16,59 @@ typedef struct http_request {
     int valid;
 } http_request;
 
+#define CONFIG_MAX_UPSTREAMS 8
+
+// How response headers and body are pushed onto the wire
+typedef enum {
+    PUSH_NAGLE,      // kernel defaults
+    PUSH_NODELAY,    // TCP_NODELAY: every send() goes out immediately
+    PUSH_CORK        // TCP_CORK per response: headers and body share segments
+} push_strategy;
+
+// Listener and per-connection socket tuning (-o key=value,...)
+typedef struct socket_options {
+    int backlog;            // listen() backlog
+    int defer_accept;       // TCP_DEFER_ACCEPT seconds, 0 = off
+    int fastopen;           // TCP_FASTOPEN queue length, 0 = off
+    push_strategy push;
+    int sndbuf;             // SO_SNDBUF bytes, 0 = kernel autotuning
+    int rcvbuf;             // SO_RCVBUF bytes, 0 = kernel autotuning
+    int busy_poll;          // SO_BUSY_POLL microseconds, 0 = off
+    int v6only;             // IPv6 listener refuses IPv4 clients
+} socket_options;
+
+// Settings that can be reloaded from a config file
+// (upstreams are only read at startup)
+typedef struct server_config {
+    char directory[256];
+    char single_file[256];
+    char log_file[256];
+    int rate_limit;         // requests/sec per client, -1 if not set
+    int rate_burst;         // token bucket size, -1 if not set
+    int max_connections;    // open connections per client, -1 if not set
+    int autoindex;          // directory listings on/off, -1 if not set
+    char upstreams[CONFIG_MAX_UPSTREAMS][256];   // "/prefix=host:port,..."
+    int upstream_count;
+    char upstream_balance[32];                   // "round_robin" or "least_conn"
+    char bind_addr[64];                          // listen address (startup only)
+    char socket_options[256];                    // -o syntax (startup only)
+} server_config;
+
+// Chunked streaming
+#define STREAM_CHUNK_SIZE  16384          // body bytes per chunk
+#define STREAM_THRESHOLD   (64 * 1024)    // larger files are streamed, not loaded whole
+#define SEND_TIMEOUT_MS    5000           // max wait for a slow reader
+#define FOLLOW_IDLE_MS     10000          // end a followed stream after this idle time
+#define FOLLOW_POLL_MS     250
+
+// Buffers data in a per-thread buffer: one open stream per thread at a time
+typedef struct chunk_stream {
+    int client_fd;
+    size_t used;          // bytes buffered for the next chunk
+    size_t bytes_sent;    // body bytes sent so far
+    int failed;
+} chunk_stream;
+
 // Log levels
 typedef enum {
     LOG_INFO,
@@ -23,40 +79,55 @@ typedef enum {
 
 
 // Server setup
-int set_server_adds(int server_fd, int port);
+int set_server_adds(int server_fd, const char *bind_addr, int port);
+void default_socket_options(socket_options *opts);
+int parse_socket_options(const char *spec, socket_options *opts);
+void set_socket_options(const socket_options *opts);
+void apply_listener_options(int server_fd, const socket_options *opts);
+void apply_connection_options(int client_fd, const socket_options *opts);
+void format_peer_addr(const struct sockaddr_storage *addr, char *out, size_t out_len);
 
 // String utilities
 int ends_with(char *input, char *extension);
 char *remove_first_n_copy(const char *s, size_t n);
 
 // File serving
-void serve_file(int client_fd, const char *filepath);
-char *get_content_type(const char *filename);
+int serve_file(int client_fd, const char *filepath, int fd, const struct stat *st,
+               int keep_alive, size_t *bytes_sent);
 
 
-// Helper functions
-void serve_file(int client_fd, const char *filepath);
-char *get_content_type(const char *filename);
+// Configuration
+int read_config_file(const char *path, server_config *cfg);
+void set_serving_paths(const char *directory, const char *single_file);
+void get_serving_paths(char *directory, size_t dir_len, char *single_file, size_t file_len);
 
+// Chunked responses
+int chunk_stream_begin(chunk_stream *stream, int client_fd, const char *content_type, int keep_alive);
+int chunk_stream_write(chunk_stream *stream, const char *data, size_t len);
+int chunk_stream_end(chunk_stream *stream);
+int stream_file(int client_fd, const char *filepath, int fd, const struct stat *st,
+                int keep_alive, int follow, size_t *bytes_sent);
 
 // Client handling
+typedef struct client_conn {
+    int fd;
+    uint64_t key;           // rate-limit key of the peer address
+    int rl_slot;            // from rl_acquire_connection, -1 if not counted
+} client_conn;
+
 void *handel_client(void *arg);
 
 // HTTP utilities
-int send_error_response(int client_fd, int code, int keep_alive);
-int send_success_response(int client_fd, char *body, char *content_type, size_t content_length);
+int send_all(int client_fd, const char *buf, size_t len);
 int get_header_value(char req[], const char *header_name, char *out_value, size_t out_len);
-http_request parse_http_request(char req[]);
+http_request parse_http_request(char req[], size_t len);
 
 // Logging functions
 void init_logging(const char *log_file);
 void close_logging(void);
+void reopen_logging(const char *log_file);
 void log_message(log_level level, const char *format, ...);
 void log_request(const char *client_ip, const char *method, const char *path, int status_code, size_t bytes_sent);
 
 
-void serve_file_keepalive(int client_fd, const char *filepath, int keep_alive);
-int send_success_response_keepalive(int client_fd, char *body, char *content_type, 
-                                    size_t content_length, int keep_alive);
-
 #endif
\ No newline at end of file
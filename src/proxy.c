@@ -0,0 +1,657 @@
+#define _GNU_SOURCE
+#include "proxy.h"
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/time.h>
+
+// Bytes moved per splice() call, matches the default pipe capacity
+#define SPLICE_CHUNK 65536
+
+// Buffered reader for upstream response headers and chunk framing
+typedef struct upstream_reader {
+    int fd;
+    size_t start;                    // first unconsumed byte
+    size_t len;                      // bytes in buf
+    char buf[PROXY_HEADER_MAX];
+} upstream_reader;
+
+static upstream_route g_routes[PROXY_MAX_ROUTES];
+static int g_route_count = 0;
+static proxy_balance g_balance = PROXY_ROUND_ROBIN;
+
+// Per-thread pipe used as the splice() buffer between the two sockets
+static __thread int t_pipe[2] = { -1, -1 };
+
+
+/**
+ * Add a route from "<prefix>=<host:port>[,<host:port>...]"
+ * @return 1 on success, 0 on a malformed spec or unresolvable backend
+ */
+int proxy_add_route(const char *spec) {
+    if (g_route_count == PROXY_MAX_ROUTES) {
+        log_message(LOG_ERROR, "Too many upstream routes (max %d)", PROXY_MAX_ROUTES);
+        return 0;
+    }
+
+    const char *eq = strchr(spec, '=');
+    if (!eq || spec[0] != '/' || (size_t)(eq - spec) >= sizeof(g_routes[0].prefix)) {
+        log_message(LOG_ERROR, "Invalid upstream '%s', expected /prefix=host:port[,host:port]", spec);
+        return 0;
+    }
+
+    upstream_route *route = &g_routes[g_route_count];
+    memset(route, 0, sizeof(*route));
+    route->prefix_len = (size_t)(eq - spec);
+    memcpy(route->prefix, spec, route->prefix_len);
+
+    char list[512];
+    snprintf(list, sizeof(list), "%s", eq + 1);
+
+    char *save = NULL;
+    for (char *item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+        if (route->backend_count == PROXY_MAX_BACKENDS) {
+            log_message(LOG_ERROR, "Too many backends for %s (max %d)", route->prefix, PROXY_MAX_BACKENDS);
+            return 0;
+        }
+
+        // host:port, with [v6addr]:port for IPv6 literals
+        char *colon = strrchr(item, ':');
+        if (!colon || colon == item) {
+            log_message(LOG_ERROR, "Invalid backend '%s', expected host:port", item);
+            return 0;
+        }
+        *colon = '\0';
+        char *host = item;
+        char *port = colon + 1;
+        size_t host_len = strlen(host);
+        if (host[0] == '[' && host[host_len - 1] == ']') {
+            host[host_len - 1] = '\0';
+            host++;
+        }
+
+        struct addrinfo hints = { .ai_family = AF_UNSPEC, .ai_socktype = SOCK_STREAM };
+        struct addrinfo *res = NULL;
+        int rc = getaddrinfo(host, port, &hints, &res);
+        if (rc != 0) {
+            log_message(LOG_ERROR, "Cannot resolve backend %s:%s: %s", host, port, gai_strerror(rc));
+            return 0;
+        }
+
+        upstream_backend *backend = &route->backends[route->backend_count++];
+        memcpy(&backend->addr, res->ai_addr, res->ai_addrlen);
+        backend->addr_len = res->ai_addrlen;
+        snprintf(backend->name, sizeof(backend->name), "%s:%s", host, port);
+        pthread_mutex_init(&backend->pool_lock, NULL);
+        freeaddrinfo(res);
+    }
+
+    if (route->backend_count == 0) {
+        log_message(LOG_ERROR, "Upstream %s has no backends", route->prefix);
+        return 0;
+    }
+
+    g_route_count++;
+    log_message(LOG_INFO, "Proxying %s to %d backend(s)", route->prefix, route->backend_count);
+    return 1;
+}
+
+void proxy_set_balance(proxy_balance mode) {
+    g_balance = mode;
+}
+
+/**
+ * Find the route for a request path (longest matching prefix)
+ * @return route, or NULL if the path is served from disk
+ */
+upstream_route *proxy_match(const char *path) {
+    upstream_route *best = NULL;
+    for (int i = 0; i < g_route_count; i++) {
+        upstream_route *route = &g_routes[i];
+        if (strncmp(path, route->prefix, route->prefix_len) == 0 &&
+            (!best || route->prefix_len > best->prefix_len))
+            best = route;
+    }
+    return best;
+}
+
+static upstream_backend *pick_backend(upstream_route *route) {
+    unsigned start = atomic_fetch_add_explicit(&route->next, 1, memory_order_relaxed);
+
+    if (g_balance == PROXY_ROUND_ROBIN)
+        return &route->backends[start % (unsigned)route->backend_count];
+
+    // Least connections; the rotating start spreads ties
+    upstream_backend *best = NULL;
+    int best_active = 0;
+    for (int i = 0; i < route->backend_count; i++) {
+        upstream_backend *backend = &route->backends[(start + (unsigned)i) % (unsigned)route->backend_count];
+        int active = atomic_load_explicit(&backend->active, memory_order_relaxed);
+        if (!best || active < best_active) {
+            best = backend;
+            best_active = active;
+        }
+    }
+    return best;
+}
+
+static int upstream_connect(upstream_backend *backend) {
+    int fd = socket(backend->addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+
+    // Request headers go out in one write; don't let Nagle hold them
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct timeval tv = { .tv_sec = PROXY_TIMEOUT_SEC, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    if (connect(fd, (struct sockaddr *)&backend->addr, backend->addr_len) != 0) {
+        log_message(LOG_ERROR, "Connect to upstream %s failed: %s", backend->name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Take an idle pooled connection, skipping ones the backend has closed
+ * @return connection, or -1 if the pool is empty
+ */
+static int pool_get(upstream_backend *backend) {
+    for (;;) {
+        pthread_mutex_lock(&backend->pool_lock);
+        int fd = backend->idle_count > 0 ? backend->idle[--backend->idle_count] : -1;
+        pthread_mutex_unlock(&backend->pool_lock);
+
+        if (fd < 0)
+            return -1;
+
+        // An idle connection should have nothing to read; EOF means it was closed
+        struct pollfd pfd = { .fd = fd, .events = POLLIN };
+        if (poll(&pfd, 1, 0) == 0)
+            return fd;
+        close(fd);
+    }
+}
+
+static void pool_put(upstream_backend *backend, int fd) {
+    pthread_mutex_lock(&backend->pool_lock);
+    if (backend->idle_count < PROXY_POOL_SIZE) {
+        backend->idle[backend->idle_count++] = fd;
+        fd = -1;
+    }
+    pthread_mutex_unlock(&backend->pool_lock);
+
+    if (fd >= 0)
+        close(fd);
+}
+
+static void reset_pipe(void) {
+    if (t_pipe[0] >= 0) {
+        close(t_pipe[0]);
+        close(t_pipe[1]);
+    }
+    t_pipe[0] = t_pipe[1] = -1;
+}
+
+void proxy_thread_cleanup(void) {
+    reset_pipe();
+}
+
+/**
+ * Move bytes between sockets through the thread's pipe, without copying
+ * them into user space
+ * @param count     - Bytes to move (ignored when until_eof is set)
+ * @param until_eof - Move everything until src is closed
+ * @param moved     - Incremented by the bytes moved
+ * @return 1 on success, 0 on error, timeout or early EOF
+ */
+static int splice_bytes(int src, int dst, size_t count, int until_eof, size_t *moved) {
+    if (t_pipe[0] < 0 && pipe2(t_pipe, O_CLOEXEC) != 0) {
+        log_message(LOG_ERROR, "pipe failed: %s", strerror(errno));
+        return 0;
+    }
+
+    while (until_eof || count > 0) {
+        size_t want = until_eof || count > SPLICE_CHUNK ? SPLICE_CHUNK : count;
+        ssize_t in = splice(src, NULL, t_pipe[1], NULL, want, SPLICE_F_MOVE | SPLICE_F_MORE);
+        if (in == 0)
+            return until_eof;
+        if (in < 0) {
+            if (errno == EINTR)
+                continue;
+            return 0;
+        }
+
+        size_t left = (size_t)in;
+        while (left > 0) {
+            ssize_t out = splice(t_pipe[0], NULL, dst, NULL, left, SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (out < 0 && errno == EINTR)
+                continue;
+            if (out <= 0) {
+                // Data is stuck in the pipe; start the next transfer with a clean one
+                reset_pipe();
+                return 0;
+            }
+            left -= (size_t)out;
+        }
+
+        *moved += (size_t)in;
+        if (!until_eof)
+            count -= (size_t)in;
+    }
+    return 1;
+}
+
+static int reader_fill(upstream_reader *r) {
+    if (r->start == r->len) {
+        r->start = r->len = 0;
+    } else if (r->len == sizeof(r->buf) && r->start > 0) {
+        memmove(r->buf, r->buf + r->start, r->len - r->start);
+        r->len -= r->start;
+        r->start = 0;
+    }
+    if (r->len == sizeof(r->buf))
+        return 0;
+
+    ssize_t n;
+    do {
+        n = recv(r->fd, r->buf + r->len, sizeof(r->buf) - r->len, 0);
+    } while (n < 0 && errno == EINTR);
+    if (n <= 0)
+        return 0;
+    r->len += (size_t)n;
+    return 1;
+}
+
+/**
+ * Get the next CRLF-terminated line from the reader (not consumed)
+ * @return line start, or NULL on error; *line_len includes the CRLF
+ */
+static char *reader_line(upstream_reader *r, size_t *line_len) {
+    for (;;) {
+        char *start = r->buf + r->start;
+        char *eol = memmem(start, r->len - r->start, "\r\n", 2);
+        if (eol) {
+            *line_len = (size_t)(eol + 2 - start);
+            return start;
+        }
+        if (!reader_fill(r))
+            return NULL;
+    }
+}
+
+static int header_is(const char *line, size_t len, const char *name) {
+    size_t name_len = strlen(name);
+    return len > name_len && strncasecmp(line, name, name_len) == 0 && line[name_len] == ':';
+}
+
+// Copy a header value (leading spaces and CRLF trimmed)
+static void header_value(const char *line, size_t len, char *out, size_t out_len) {
+    const char *value = (const char *)memchr(line, ':', len) + 1;
+    const char *end = line + len;
+    while (value < end && (*value == ' ' || *value == '\t')) value++;
+    while (end > value && (end[-1] == '\r' || end[-1] == '\n' || end[-1] == ' ')) end--;
+    size_t n = (size_t)(end - value) < out_len - 1 ? (size_t)(end - value) : out_len - 1;
+    memcpy(out, value, n);
+    out[n] = '\0';
+}
+
+static int is_hop_by_hop(const char *line, size_t len) {
+    return header_is(line, len, "Connection") || header_is(line, len, "Keep-Alive") ||
+           header_is(line, len, "Proxy-Connection") || header_is(line, len, "TE") ||
+           header_is(line, len, "Trailer") || header_is(line, len, "Upgrade");
+}
+
+// Safe to send twice: a stale pooled connection may have eaten the first
+static int is_idempotent(const char *method) {
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0 ||
+           strcmp(method, "PUT") == 0 || strcmp(method, "DELETE") == 0 ||
+           strcmp(method, "OPTIONS") == 0 || strcmp(method, "TRACE") == 0;
+}
+
+static int append(char *out, size_t out_size, size_t *out_len, const char *data, size_t len) {
+    if (*out_len + len > out_size)
+        return 0;
+    memcpy(out + *out_len, data, len);
+    *out_len += len;
+    return 1;
+}
+
+size_t proxy_build_request(const char *req, const char *hdr_end, const char *client_ip,
+                           char *out, size_t out_size) {
+    size_t out_len = 0;
+    char forwarded[512] = {0};
+
+    // Every scan is bounded by the header block; it may contain anything
+    if (memchr(req, '\0', (size_t)(hdr_end - req)))
+        return 0;
+
+    /**
+     * get_header_value() splits lines on a bare LF but this rewrite splits
+     * on CRLF; a bare LF would let a header (X-Forwarded-For, Connection)
+     * hide inside another one here and still be seen by the backend
+     */
+    for (const char *lf = req; (lf = memchr(lf, '\n', (size_t)(hdr_end - lf))) != NULL; lf++) {
+        if (lf == req || lf[-1] != '\r')
+            return 0;
+    }
+
+    const char *line = req;
+    const char *eol = memmem(line, (size_t)(hdr_end + 2 - line), "\r\n", 2);
+    if (!append(out, out_size, &out_len, line, (size_t)(eol + 2 - line)))
+        return 0;
+
+    for (line = eol + 2; line < hdr_end + 2; line = eol + 2) {
+        eol = memmem(line, (size_t)(hdr_end + 2 - line), "\r\n", 2);
+        size_t len = (size_t)(eol + 2 - line);
+
+        if (header_is(line, len, "X-Forwarded-For")) {
+            header_value(line, len, forwarded, sizeof(forwarded));
+            continue;
+        }
+        // Expect: 100-continue is answered here (see proxy_forward)
+        if (is_hop_by_hop(line, len) || header_is(line, len, "Expect"))
+            continue;
+        if (!append(out, out_size, &out_len, line, len))
+            return 0;
+    }
+
+    char extra[640];
+    int extra_len = snprintf(extra, sizeof(extra),
+                             "X-Forwarded-For: %s%s%s\r\n"
+                             "Connection: keep-alive\r\n"
+                             "\r\n",
+                             forwarded, forwarded[0] ? ", " : "", client_ip);
+    if (extra_len < 0 || (size_t)extra_len >= sizeof(extra) ||
+        !append(out, out_size, &out_len, extra, (size_t)extra_len))
+        return 0;
+    return out_len;
+}
+
+/**
+ * Read up to the end of the final response's header block, dropping any
+ * interim 1xx responses (100 Continue, 103 Early Hints) before it
+ * @return 1 with the header block at the start of r->buf, 0 on error or EOF
+ */
+static int read_response_head(upstream_reader *r) {
+    for (;;) {
+        char *end;
+        while ((end = memmem(r->buf, r->len, "\r\n\r\n", 4)) == NULL) {
+            if (!reader_fill(r))
+                return 0;
+        }
+        int status = r->len >= 12 && strncmp(r->buf, "HTTP/1.", 7) == 0 ? atoi(r->buf + 9) : 0;
+        if (status < 100 || status > 199 || status == 101)
+            return 1;
+
+        end += 4;
+        r->len -= (size_t)(end - r->buf);
+        memmove(r->buf, end, r->len);
+    }
+}
+
+/**
+ * Relay a chunked body, forwarding the framing as-is and splicing the
+ * chunk data
+ */
+static int relay_chunked(upstream_reader *r, int client_fd, size_t *body_bytes) {
+    for (;;) {
+        size_t line_len;
+        char *line = reader_line(r, &line_len);
+        if (!line)
+            return 0;
+
+        char *end;
+        unsigned long long size = strtoull(line, &end, 16);
+        if (end == line || !send_all(client_fd, line, line_len))
+            return 0;
+        r->start += line_len;
+
+        if (size == 0) {
+            // Trailer fields, up to the empty line
+            do {
+                line = reader_line(r, &line_len);
+                if (!line || !send_all(client_fd, line, line_len))
+                    return 0;
+                r->start += line_len;
+            } while (line_len != 2);
+            return 1;
+        }
+
+        size_t buffered = r->len - r->start;
+        size_t take = buffered < size ? buffered : (size_t)size;
+        if (take && !send_all(client_fd, r->buf + r->start, take))
+            return 0;
+        r->start += take;
+        *body_bytes += take;
+        if (size > take && !splice_bytes(r->fd, client_fd, (size_t)size - take, 0, body_bytes))
+            return 0;
+
+        line = reader_line(r, &line_len);
+        if (!line || line_len != 2 || !send_all(client_fd, line, line_len))
+            return 0;
+        r->start += line_len;
+    }
+}
+
+int proxy_forward(int client_fd, upstream_route *route, const char *req, size_t req_len,
+                  const http_request *request, const char *client_ip,
+                  int *keep_alive, size_t *bytes_sent) {
+    *bytes_sent = 0;
+
+    const char *hdr_end = memmem(req, req_len, "\r\n\r\n", 4);
+    char tmp[64];
+    if (!hdr_end) {
+        send_error_response(client_fd, 400, 0);
+        *keep_alive = 0;
+        return 400;
+    }
+    if (get_header_value((char *)req, "Transfer-Encoding", tmp, sizeof(tmp))) {
+        // Chunked request bodies aren't supported
+        send_error_response(client_fd, 501, 0);
+        *keep_alive = 0;
+        return 501;
+    }
+
+    char out[PROXY_HEADER_MAX];
+    size_t out_len = proxy_build_request(req, hdr_end, client_ip, out, sizeof(out));
+    if (out_len == 0) {
+        send_error_response(client_fd, 400, 0);
+        *keep_alive = 0;
+        return 400;
+    }
+
+    const char *body = hdr_end + 4;
+    size_t body_len = request->content_length > 0 ? (size_t)request->content_length : 0;
+    size_t body_buffered = (size_t)(req + req_len - body);
+    if (body_buffered > body_len)
+        body_buffered = body_len;
+
+    /**
+     * The backend never sees Expect; a client waiting for 100 Continue gets
+     * it from us before its body is streamed upstream
+     */
+    char expect[32];
+    if (body_len > body_buffered && strcmp(request->version, "HTTP/1.1") == 0 &&
+        get_header_value((char *)req, "Expect", expect, sizeof(expect)) &&
+        strcasecmp(expect, "100-continue") == 0)
+        send_all(client_fd, "HTTP/1.1 100 Continue\r\n\r\n", 25);
+
+    upstream_backend *backend = pick_backend(route);
+    atomic_fetch_add(&backend->active, 1);
+
+    static __thread upstream_reader r;
+    int upstream_fd = -1;
+    int status = 502;
+    int body_consumed = body_len == body_buffered;
+
+    /**
+     * A pooled connection may have been closed by the backend just as we
+     * reused it; retry once on a newly opened connection (the rest of the
+     * pool may be just as stale) if nothing came back
+     * (only for idempotent methods, and only when the request body hasn't
+     * been streamed from the client).
+     * A backend that refuses the connection is also retried once elsewhere.
+     */
+    int skip_pool = 0;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        int pooled = !skip_pool;
+        upstream_fd = pooled ? pool_get(backend) : -1;
+        if (upstream_fd < 0) {
+            pooled = 0;
+            upstream_fd = upstream_connect(backend);
+            if (upstream_fd < 0) {
+                // Backend down: give the request one other backend
+                if (attempt > 0 || route->backend_count == 1)
+                    break;
+                atomic_fetch_sub(&backend->active, 1);
+                backend = pick_backend(route);
+                atomic_fetch_add(&backend->active, 1);
+                continue;
+            }
+        }
+        trace_mark(TRACE_OPENED);
+
+        size_t streamed = 0;
+        int sent = send_all(upstream_fd, out, out_len) &&
+                   (!body_buffered || send_all(upstream_fd, body, body_buffered)) &&
+                   (body_len == body_buffered ||
+                    splice_bytes(client_fd, upstream_fd, body_len - body_buffered, 0, &streamed));
+        if (sent)
+            body_consumed = 1;
+
+        r.fd = upstream_fd;
+        r.start = r.len = 0;
+        if (sent && read_response_head(&r))
+            break;
+
+        close(upstream_fd);
+        upstream_fd = -1;
+        if (!pooled || r.len > 0 || body_len != body_buffered || !is_idempotent(request->method))
+            break;
+        skip_pool = 1;
+    }
+
+    // Unread body bytes would be parsed as the next request
+    if (!body_consumed)
+        *keep_alive = 0;
+
+    if (upstream_fd < 0) {
+        log_message(LOG_ERROR, "Upstream %s failed for %s", backend->name, request->path);
+        atomic_fetch_sub(&backend->active, 1);
+        send_error_response(client_fd, 502, *keep_alive);
+        return 502;
+    }
+
+    // Status line: "HTTP/1.x NNN reason"; 1xx were skipped, 101 isn't supported
+    char *resp_hdr_end = memmem(r.buf, r.len, "\r\n\r\n", 4);
+    size_t header_block = (size_t)(resp_hdr_end + 4 - r.buf);
+    int upstream_http10 = strncmp(r.buf, "HTTP/1.0", 8) == 0;
+    if (r.len < 12 || strncmp(r.buf, "HTTP/1.", 7) != 0 ||
+        (status = atoi(r.buf + 9)) < 200 || status > 599) {
+        close(upstream_fd);
+        atomic_fetch_sub(&backend->active, 1);
+        send_error_response(client_fd, 502, *keep_alive);
+        return 502;
+    }
+
+    long long content_length = -1;
+    int chunked = 0;
+    int upstream_close = upstream_http10;
+    char value[64];
+
+    // Forward headers, replacing the hop-by-hop ones with our own
+    char client_hdr[PROXY_HEADER_MAX + 128];
+    size_t client_len = 0;
+    char *line = r.buf;
+    char *eol = memmem(line, header_block, "\r\n", 2);
+    append(client_hdr, sizeof(client_hdr), &client_len, line, (size_t)(eol + 2 - line));
+
+    for (line = eol + 2; line < resp_hdr_end + 2; line = eol + 2) {
+        eol = memmem(line, (size_t)(resp_hdr_end + 2 - line), "\r\n", 2);
+        size_t len = (size_t)(eol + 2 - line);
+
+        if (header_is(line, len, "Content-Length")) {
+            header_value(line, len, value, sizeof(value));
+            content_length = strtoll(value, NULL, 10);
+        } else if (header_is(line, len, "Transfer-Encoding")) {
+            header_value(line, len, value, sizeof(value));
+            chunked = strcasestr(value, "chunked") != NULL;
+        } else if (header_is(line, len, "Connection")) {
+            header_value(line, len, value, sizeof(value));
+            if (strcasestr(value, "close"))
+                upstream_close = 1;
+            else if (strcasestr(value, "keep-alive"))
+                upstream_close = 0;
+        }
+        if (is_hop_by_hop(line, len))
+            continue;
+        append(client_hdr, sizeof(client_hdr), &client_len, line, len);
+    }
+
+    int no_body = strcmp(request->method, "HEAD") == 0 || status == 204 || status == 304;
+    int until_eof = !no_body && !chunked && content_length < 0;
+    if (until_eof) {
+        // Body ends when the backend closes: the client can't keep this connection
+        *keep_alive = 0;
+        upstream_close = 1;
+    }
+
+    const char *connection = *keep_alive ? "Connection: keep-alive\r\n"
+                                           "Keep-Alive: timeout=5, max=100\r\n\r\n"
+                                         : "Connection: close\r\n\r\n";
+    append(client_hdr, sizeof(client_hdr), &client_len, connection, strlen(connection));
+
+    int ok = send_all(client_fd, client_hdr, client_len);
+    if (ok)
+        trace_mark(TRACE_HEADERS_SENT);
+    r.start = header_block;
+
+    if (ok && !no_body) {
+        if (chunked) {
+            ok = relay_chunked(&r, client_fd, bytes_sent);
+        } else {
+            size_t buffered = r.len - r.start;
+            if (!until_eof && buffered > (size_t)content_length)
+                buffered = (size_t)content_length;
+            ok = !buffered || send_all(client_fd, r.buf + r.start, buffered);
+            r.start += buffered;
+            *bytes_sent += buffered;
+            if (ok && (until_eof || (size_t)content_length > buffered))
+                ok = splice_bytes(upstream_fd, client_fd,
+                                  until_eof ? 0 : (size_t)content_length - buffered,
+                                  until_eof, bytes_sent);
+        }
+    }
+
+    if (ok)
+        trace_mark(TRACE_BODY_SENT);
+
+    // Reuse only a connection left exactly at a response boundary
+    if (ok && !upstream_close && r.start == r.len)
+        pool_put(backend, upstream_fd);
+    else
+        close(upstream_fd);
+    atomic_fetch_sub(&backend->active, 1);
+
+    if (!ok) {
+        log_message(LOG_ERROR, "Relaying response from %s failed", backend->name);
+        // Headers are already out; the only way to signal failure is to close
+        *keep_alive = 0;
+        shutdown(client_fd, SHUT_RDWR);
+    }
+    return status;
+}
@@ -0,0 +1,75 @@
+#ifndef PROXY_H
+#define PROXY_H
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "netlib.h"
+
+/**
+ * Reverse proxy / upstream mode
+ *
+ * Requests whose path starts with a configured prefix (e.g. "/api/") are
+ * forwarded to one of that route's backends instead of being served from
+ * disk. Backend connections are kept alive and pooled per backend, and
+ * response bodies are moved to the client with splice() through a
+ * per-thread pipe, so they are never copied into user space.
+ */
+
+#define PROXY_MAX_ROUTES    8
+#define PROXY_MAX_BACKENDS  8
+#define PROXY_POOL_SIZE     32       // idle connections kept per backend
+#define PROXY_TIMEOUT_SEC   10       // upstream connect/send/recv timeout
+#define PROXY_HEADER_MAX    8192     // upstream response header block
+
+typedef enum {
+    PROXY_ROUND_ROBIN,
+    PROXY_LEAST_CONN
+} proxy_balance;
+
+typedef struct upstream_backend {
+    char name[128];                  // "host:port", for logs
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+    atomic_int active;               // requests in flight
+    pthread_mutex_t pool_lock;
+    int idle[PROXY_POOL_SIZE];       // pooled keep-alive connections
+    int idle_count;
+} upstream_backend;
+
+typedef struct upstream_route {
+    char prefix[128];
+    size_t prefix_len;
+    upstream_backend backends[PROXY_MAX_BACKENDS];
+    int backend_count;
+    atomic_uint next;                // round-robin cursor
+} upstream_route;
+
+int proxy_add_route(const char *spec);
+void proxy_set_balance(proxy_balance mode);
+upstream_route *proxy_match(const char *path);
+
+/**
+ * Forward one request and relay the response
+ * @param req        - Raw request as received (headers and any body bytes)
+ * @param keep_alive - In: client keep-alive; cleared if the connection must close
+ * @param bytes_sent - Response body bytes relayed
+ * @return HTTP status code sent to the client
+ */
+int proxy_forward(int client_fd, upstream_route *route, const char *req, size_t req_len,
+                  const http_request *request, const char *client_ip,
+                  int *keep_alive, size_t *bytes_sent);
+
+/**
+ * Rewrite the client's request for the backend: drop hop-by-hop headers,
+ * extend X-Forwarded-For and ask for a persistent connection
+ * @param hdr_end - Start of the "\r\n\r\n" ending the client's header block
+ * @return length of the rewritten header block, 0 if it doesn't fit or
+ * is malformed
+ */
+size_t proxy_build_request(const char *req, const char *hdr_end, const char *client_ip,
+                           char *out, size_t out_size);
+
+void proxy_thread_cleanup(void);
+
+#endif
@@ -0,0 +1,295 @@
+#include "ratelimit.h"
+#include <stddef.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <limits.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/random.h>
+#include <netinet/in.h>
+
+/**
+ * Bucket state is packed into one 64-bit word so a refill-and-take is a
+ * single CAS: high 32 bits = last refill time (ms, wrapping), low 32 bits
+ * = tokens in thousandths.
+ */
+#define RL_TOKEN_SCALE 1000u
+
+// Connection count of a slot while claim_slot() re-keys it
+#define RL_CLAIMED (INT_MIN / 2)
+
+typedef struct rl_slot {
+    _Atomic uint64_t key;          // 0 = empty
+    _Atomic uint64_t bucket;       // packed refill time + tokens
+    atomic_int connections;        // currently open connections
+    _Atomic uint32_t last_seen;    // seconds, for idle eviction
+} rl_slot;
+
+typedef struct rl_shard {
+    rl_slot slots[RL_SLOTS_PER_SHARD];
+} __attribute__((aligned(64))) rl_shard;
+
+static rl_shard g_shards[RL_SHARDS];
+
+// Current limits, swapped on SIGHUP reload
+static atomic_int g_rate = 0;
+static atomic_int g_burst = 0;
+static atomic_int g_max_conns = 0;
+
+// Random per-process hash seed, so clients can't pick addresses that share a probe window
+static uint64_t g_seed = 0;
+
+
+static uint32_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+static uint32_t now_sec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint32_t)ts.tv_sec;
+}
+
+static uint64_t pack_bucket(uint32_t time_ms, uint32_t tokens) {
+    return ((uint64_t)time_ms << 32) | tokens;
+}
+
+static uint32_t bucket_capacity(void) {
+    int burst = atomic_load_explicit(&g_burst, memory_order_relaxed);
+    if (burst <= 0)
+        burst = atomic_load_explicit(&g_rate, memory_order_relaxed);
+    return (uint32_t)burst * RL_TOKEN_SCALE;
+}
+
+/**
+ * Set new limits
+ * Existing buckets keep their tokens and are clamped to the new burst on
+ * their next refill. The first call (at startup, before any key is made)
+ * also picks the hash seed.
+ */
+void rl_configure(const rl_limits *limits) {
+    if (g_seed == 0) {
+        if (getrandom(&g_seed, sizeof(g_seed), 0) != (ssize_t)sizeof(g_seed)) {
+            struct timespec ts;
+            clock_gettime(CLOCK_REALTIME, &ts);
+            g_seed = ((uint64_t)ts.tv_sec << 32) ^ (uint64_t)ts.tv_nsec ^ ((uint64_t)getpid() << 16);
+        }
+        g_seed |= 1;
+    }
+    atomic_store(&g_rate, limits->requests_per_sec > 0 ? limits->requests_per_sec : 0);
+    atomic_store(&g_burst, limits->burst > 0 ? limits->burst : 0);
+    atomic_store(&g_max_conns, limits->max_connections > 0 ? limits->max_connections : 0);
+}
+
+/**
+ * Hash a client address to a table key (never 0)
+ */
+uint64_t rl_key_from_addr(const struct sockaddr *addr) {
+    uint64_t h = 0x9e3779b97f4a7c15ULL ^ g_seed;
+    const unsigned char *bytes = NULL;
+    size_t len = 0;
+
+    if (addr->sa_family == AF_INET) {
+        bytes = (const unsigned char *)&((const struct sockaddr_in *)addr)->sin_addr;
+        len = sizeof(struct in_addr);
+    } else if (addr->sa_family == AF_INET6) {
+        const struct in6_addr *a6 = &((const struct sockaddr_in6 *)addr)->sin6_addr;
+        if (IN6_IS_ADDR_V4MAPPED(a6)) {
+            // IPv4 over a dual-stack listener shares the plain IPv4 client's bucket
+            bytes = a6->s6_addr + 12;
+            len = sizeof(struct in_addr);
+        } else {
+            // One host usually owns a whole /64, so limit per /64 prefix
+            bytes = a6->s6_addr;
+            len = 8;
+        }
+    }
+    // FNV-1a over the address bytes, then a splitmix64 finalizer
+    for (size_t i = 0; i < len; i++) {
+        h ^= bytes[i];
+        h *= 0x100000001b3ULL;
+    }
+    h ^= h >> 30; h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27; h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h ? h : 1;
+}
+
+/**
+ * Wait out another thread's claim_slot() on this slot (a few stores)
+ */
+static void wait_for_claim(rl_slot *slot) {
+    while (atomic_load(&slot->connections) < 0)
+        sched_yield();
+}
+
+/**
+ * Take a slot over for key
+ * Ownership is a CAS of the connection count from 0 to RL_CLAIMED, so a
+ * slot with open connections is never taken, and a connection counted
+ * meanwhile sees the claim (see rl_acquire_connection). The key is only
+ * published once the bucket is reset.
+ * @param seen - Key the caller found in the slot
+ * @return 1 if the slot now belongs to key
+ */
+static int claim_slot(rl_slot *slot, uint64_t seen, uint64_t key, uint32_t sec) {
+    int idle = 0;
+    if (!atomic_compare_exchange_strong(&slot->connections, &idle, RL_CLAIMED))
+        return 0;
+    if (atomic_load(&slot->key) != seen) {
+        // Another thread re-keyed it after we looked
+        atomic_fetch_sub(&slot->connections, RL_CLAIMED);
+        return 0;
+    }
+
+    atomic_store_explicit(&slot->bucket, pack_bucket(now_ms(), bucket_capacity()),
+                          memory_order_relaxed);
+    atomic_store_explicit(&slot->last_seen, sec, memory_order_relaxed);
+    atomic_store(&slot->key, key);
+
+    // Remove the claim rather than store 0, so counts taken and undone meanwhile net out
+    atomic_fetch_sub(&slot->connections, RL_CLAIMED);
+    return 1;
+}
+
+/**
+ * Find the slot for a key, claiming an empty one or evicting the
+ * longest-idle entry with no open connections if needed
+ * @return slot, or NULL if every probed slot has open connections
+ */
+static rl_slot *find_slot(uint64_t key) {
+    rl_shard *shard = &g_shards[(key >> 48) % RL_SHARDS];
+    size_t start = (size_t)key % RL_SLOTS_PER_SHARD;
+    uint32_t sec = now_sec();
+    rl_slot *oldest = NULL;
+    uint64_t oldest_key = 0;
+    uint32_t oldest_age = 0;
+
+    for (size_t i = 0; i < RL_MAX_PROBE; i++) {
+        rl_slot *slot = &shard->slots[(start + i) % RL_SLOTS_PER_SHARD];
+        wait_for_claim(slot);
+        uint64_t cur = atomic_load(&slot->key);
+
+        if (cur == key) {
+            atomic_store_explicit(&slot->last_seen, sec, memory_order_relaxed);
+            return slot;
+        }
+
+        if (cur == 0) {
+            if (claim_slot(slot, 0, key, sec))
+                return slot;
+            // Lost the race: the winner may have been inserting the same key
+            wait_for_claim(slot);
+            if (atomic_load(&slot->key) == key)
+                return slot;
+            continue;
+        }
+
+        // Remember the longest-idle entry with no open connections
+        uint32_t age = sec - atomic_load_explicit(&slot->last_seen, memory_order_relaxed);
+        if ((!oldest || age > oldest_age) && atomic_load(&slot->connections) == 0) {
+            oldest = slot;
+            oldest_key = cur;
+            oldest_age = age;
+        }
+    }
+
+    if (oldest) {
+        if (claim_slot(oldest, oldest_key, key, sec))
+            return oldest;
+        wait_for_claim(oldest);
+        if (atomic_load(&oldest->key) == key)
+            return oldest;
+    }
+    return NULL;
+}
+
+/**
+ * Count a new connection from a client
+ * Connections are counted even while the cap is off, so the counts are
+ * right if a reload switches it on.
+ * @param slot - Set to the slot the connection was counted in, to pass to
+ *               rl_release_connection when it closes; -1 if not counted
+ * @return 1 if under the per-client connection cap, 0 if it must be refused
+ */
+int rl_acquire_connection(uint64_t key, int *slot) {
+    int max = atomic_load_explicit(&g_max_conns, memory_order_relaxed);
+    *slot = -1;
+
+    for (int attempt = 0; attempt < RL_MAX_PROBE; attempt++) {
+        rl_slot *found = find_slot(key);
+        if (!found)
+            break;
+
+        int open = atomic_fetch_add(&found->connections, 1);
+        if (open < 0 || atomic_load(&found->key) != key) {
+            // The slot was re-keyed after find_slot() returned it
+            atomic_fetch_sub(&found->connections, 1);
+            continue;
+        }
+        if (open >= max && max > 0) {
+            atomic_fetch_sub(&found->connections, 1);
+            return 0;
+        }
+        *slot = (int)(found - &g_shards[0].slots[0]);
+        return 1;
+    }
+    return max <= 0;  // table window full of open connections: fail closed
+}
+
+/**
+ * Uncount a connection that rl_acquire_connection counted
+ * The slot is passed back rather than looked up by key: it can't have
+ * been evicted while the connection was open, but two threads inserting
+ * the same new key at once can leave that key in two slots.
+ */
+void rl_release_connection(int slot) {
+    if (slot < 0)
+        return;
+    atomic_fetch_sub(&g_shards[slot / RL_SLOTS_PER_SHARD].slots[slot % RL_SLOTS_PER_SHARD].connections, 1);
+}
+
+/**
+ * Take one token from the client's bucket
+ * @return 1 if the request may proceed, 0 if it should get a 429
+ */
+int rl_allow_request(uint64_t key) {
+    int rate = atomic_load_explicit(&g_rate, memory_order_relaxed);
+    if (rate <= 0)
+        return 1;
+
+    rl_slot *slot = find_slot(key);
+    if (!slot)
+        return 0;  // fail closed, see rl_acquire_connection
+
+    uint32_t capacity = bucket_capacity();
+    uint32_t now = now_ms();
+    uint64_t state = atomic_load_explicit(&slot->bucket, memory_order_relaxed);
+
+    for (;;) {
+        uint32_t last = (uint32_t)(state >> 32);
+        uint32_t tokens = (uint32_t)state;
+
+        // Another thread may have stored a slightly later time already
+        uint32_t elapsed = (int32_t)(now - last) > 0 ? now - last : 0;
+        uint32_t stamp = elapsed ? now : last;
+
+        // rate tokens/sec == rate thousandths of a token per ms
+        uint64_t refilled = tokens + (uint64_t)elapsed * (uint64_t)rate;
+        if (refilled > capacity)
+            refilled = capacity;
+
+        int allowed = refilled >= RL_TOKEN_SCALE;
+        if (allowed)
+            refilled -= RL_TOKEN_SCALE;
+
+        uint64_t next = pack_bucket(stamp, (uint32_t)refilled);
+        if (atomic_compare_exchange_weak_explicit(&slot->bucket, &state, next,
+                                                  memory_order_relaxed,
+                                                  memory_order_relaxed))
+            return allowed;
+    }
+}
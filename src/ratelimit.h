@@ -0,0 +1,37 @@
+#ifndef RATELIMIT_H
+#define RATELIMIT_H
+#include <stdint.h>
+#include <sys/socket.h>
+
+/**
+ * Per-client rate limiting
+ *
+ * A fixed-size, sharded hash table keyed by client address holds one
+ * token bucket and one open-connection counter per client. Lookups and
+ * updates are lock-free (a handful of atomic loads and one CAS). When a
+ * key's probe window is full, the longest-idle entry with no open
+ * connections is reused, so memory stays bounded; if every probed entry
+ * has open connections the client is refused. IPv6 clients are keyed by
+ * their /64 prefix.
+ */
+
+#define RL_SHARDS           16
+#define RL_SLOTS_PER_SHARD  1024
+#define RL_MAX_PROBE        8
+
+// Limits; a value of 0 disables that check
+typedef struct rl_limits {
+    int requests_per_sec;   // token refill rate
+    int burst;              // bucket size (defaults to requests_per_sec)
+    int max_connections;    // concurrent connections per client
+} rl_limits;
+
+void rl_configure(const rl_limits *limits);
+uint64_t rl_key_from_addr(const struct sockaddr *addr);
+
+// Return 1 if allowed, 0 if the client is over its limit
+int rl_acquire_connection(uint64_t key, int *slot);
+void rl_release_connection(int slot);
+int rl_allow_request(uint64_t key);
+
+#endif
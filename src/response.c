@@ -0,0 +1,274 @@
+#include "response.h"
+#include "netlib.h"
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+/**
+ * Statuses and content types the server sends
+ * Each combination gets its own constant header block below.
+ */
+#define RESPONSE_STATUSES(X)                      \
+    X(200, "OK")                                  \
+    X(400, "Bad Request")                         \
+    X(401, "Unauthorized")                        \
+    X(403, "Forbidden")                           \
+    X(404, "Not Found")                           \
+    X(405, "Method Not Allowed")                  \
+    X(408, "Request Timeout")                     \
+    X(429, "Too Many Requests")                   \
+    X(500, "Internal Server Error")               \
+    X(501, "Not Implemented")                     \
+    X(502, "Bad Gateway")
+
+#define RESPONSE_CONTENT_TYPES(X, ...)            \
+    X(__VA_ARGS__, "text/html")                   \
+    X(__VA_ARGS__, "text/css")                    \
+    X(__VA_ARGS__, "text/javascript")             \
+    X(__VA_ARGS__, "application/json")            \
+    X(__VA_ARGS__, "image/png")                   \
+    X(__VA_ARGS__, "image/jpeg")                  \
+    X(__VA_ARGS__, "image/gif")                   \
+    X(__VA_ARGS__, "image/svg+xml")               \
+    X(__VA_ARGS__, "text/plain")                  \
+    X(__VA_ARGS__, "application/octet-stream")    \
+    X(__VA_ARGS__, "text/html; charset=utf-8")
+
+#define CONNECTION_CLOSE "Connection: close\r\n"
+#define CONNECTION_KEEP  "Connection: keep-alive\r\nKeep-Alive: timeout=5, max=100\r\n"
+
+typedef struct header_block {
+    const char *data;
+    size_t len;
+} header_block;
+
+#define BLOCK(s) { s, sizeof(s) - 1 }
+#define STATUS_LINE(code, reason) "HTTP/1.1 " #code " " reason "\r\n"
+
+// blocks[status][content type][keep_alive]; the last content type column is "none"
+#define TYPED_PAIR(code, reason, type)                                                  \
+    { BLOCK(STATUS_LINE(code, reason) "Content-Type: " type "\r\n" CONNECTION_CLOSE),  \
+      BLOCK(STATUS_LINE(code, reason) "Content-Type: " type "\r\n" CONNECTION_KEEP) },
+#define STATUS_ROW(code, reason)                                   \
+    { RESPONSE_CONTENT_TYPES(TYPED_PAIR, code, reason)             \
+      { BLOCK(STATUS_LINE(code, reason) CONNECTION_CLOSE),         \
+        BLOCK(STATUS_LINE(code, reason) CONNECTION_KEEP) } },
+#define TYPE_NAME(unused, type) type,
+#define STATUS_CODE(code, reason) code,
+
+static const char *const content_types[] = { RESPONSE_CONTENT_TYPES(TYPE_NAME, 0) };
+#define CONTENT_TYPE_COUNT (sizeof(content_types) / sizeof(content_types[0]))
+
+static const int status_codes[] = { RESPONSE_STATUSES(STATUS_CODE) };
+#define STATUS_COUNT (sizeof(status_codes) / sizeof(status_codes[0]))
+
+static const header_block blocks[STATUS_COUNT][CONTENT_TYPE_COUNT + 1][2] = {
+    RESPONSE_STATUSES(STATUS_ROW)
+};
+
+enum {
+    CT_HTML, CT_CSS, CT_JS, CT_JSON, CT_PNG, CT_JPEG, CT_GIF, CT_SVG, CT_TEXT, CT_BINARY
+};
+
+#define EXTENSION(ext, type) { ext, sizeof(ext) - 1, type }
+
+static const struct {
+    const char *extension;
+    size_t length;
+    int type;
+} extension_types[] = {
+    EXTENSION(".html", CT_HTML), EXTENSION(".htm", CT_HTML), EXTENSION(".css", CT_CSS),
+    EXTENSION(".js", CT_JS), EXTENSION(".json", CT_JSON), EXTENSION(".png", CT_PNG),
+    EXTENSION(".jpg", CT_JPEG), EXTENSION(".jpeg", CT_JPEG), EXTENSION(".gif", CT_GIF),
+    EXTENSION(".svg", CT_SVG), EXTENSION(".txt", CT_TEXT),
+};
+
+/**
+ * Cached "Date: " value, re-formatted at most once per second
+ * The thread that notices a new second formats it into the next slot and
+ * publishes the slot index; readers copy whichever slot is current.
+ */
+static char g_date_slots[HTTP_DATE_SLOTS][HTTP_DATE_LEN + 1] = {
+    [0] = "Thu, 01 Jan 1970 00:00:00 GMT"
+};
+static atomic_uint g_date_slot = 0;
+static atomic_llong g_date_second = 0;
+static atomic_flag g_date_updating = ATOMIC_FLAG_INIT;
+
+
+char *get_content_type(const char *filename) {
+    // Compare only the extension, and only against entries of that length
+    const char *dot = strrchr(filename, '.');
+    if (dot) {
+        size_t len = strlen(dot);
+        for (size_t i = 0; i < sizeof(extension_types) / sizeof(extension_types[0]); i++) {
+            if (extension_types[i].length == len &&
+                memcmp(dot, extension_types[i].extension, len) == 0)
+                return (char *)content_types[extension_types[i].type];
+        }
+    }
+    return (char *)content_types[CT_BINARY];
+}
+
+static int status_index(int status) {
+    for (size_t i = 0; i < STATUS_COUNT; i++) {
+        if (status_codes[i] == status)
+            return (int)i;
+    }
+    return -1;
+}
+
+/**
+ * Column for a content type: pointers from get_content_type() match
+ * directly, other strings by value; -1 if it has no prebuilt block
+ */
+static int content_type_index(const char *content_type) {
+    if (content_type == NULL)
+        return CONTENT_TYPE_COUNT;
+    for (size_t i = 0; i < CONTENT_TYPE_COUNT; i++) {
+        if (content_types[i] == content_type)
+            return (int)i;
+    }
+    for (size_t i = 0; i < CONTENT_TYPE_COUNT; i++) {
+        if (strcmp(content_types[i], content_type) == 0)
+            return (int)i;
+    }
+    return -1;
+}
+
+static const char *current_date(void) {
+    time_t now = time(NULL);
+    if ((long long)now != atomic_load_explicit(&g_date_second, memory_order_relaxed) &&
+        !atomic_flag_test_and_set(&g_date_updating)) {
+        unsigned next = (atomic_load(&g_date_slot) + 1) % HTTP_DATE_SLOTS;
+        struct tm tm;
+        gmtime_r(&now, &tm);
+        strftime(g_date_slots[next], sizeof(g_date_slots[next]), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+        atomic_store_explicit(&g_date_slot, next, memory_order_release);
+        atomic_store_explicit(&g_date_second, (long long)now, memory_order_relaxed);
+        atomic_flag_clear(&g_date_updating);
+    }
+    return g_date_slots[atomic_load_explicit(&g_date_slot, memory_order_acquire)];
+}
+
+char *format_uint(char *end, uint64_t v, unsigned base) {
+    do {
+        *--end = "0123456789abcdef"[v % base];
+        v /= base;
+    } while (v);
+    return end;
+}
+
+static char *append(char *out, const char *data, size_t len) {
+    memcpy(out, data, len);
+    return out + len;
+}
+
+#define APPEND_LITERAL(out, s) append(out, s, sizeof(s) - 1)
+
+size_t build_response_header(char *out, int status, const char *content_type, int keep_alive,
+                             long long content_length, const struct stat *st) {
+    int row = status_index(status);
+    if (row < 0)
+        row = status_index(500);
+    int column = content_type_index(content_type);
+    keep_alive = keep_alive ? 1 : 0;
+
+    char *p = out;
+    if (column >= 0) {
+        const header_block *block = &blocks[row][column][keep_alive];
+        p = append(p, block->data, block->len);
+    } else {
+        // Uncommon type: "none" block with the Content-Type line spliced in
+        const header_block *block = &blocks[row][CONTENT_TYPE_COUNT][keep_alive];
+        size_t status_len = (size_t)((const char *)memchr(block->data, '\n', block->len) - block->data) + 1;
+        size_t type_len = strnlen(content_type, 128);
+        p = append(p, block->data, status_len);
+        p = APPEND_LITERAL(p, "Content-Type: ");
+        p = append(p, content_type, type_len);
+        p = APPEND_LITERAL(p, "\r\n");
+        p = append(p, block->data + status_len, block->len - status_len);
+    }
+
+    p = APPEND_LITERAL(p, "Date: ");
+    p = append(p, current_date(), HTTP_DATE_LEN);
+    p = APPEND_LITERAL(p, "\r\n");
+
+    char digits[24];
+    char *end = digits + sizeof(digits);
+    if (st) {
+        // Same shape as nginx: "<mtime hex>-<size hex>"
+        p = APPEND_LITERAL(p, "ETag: \"");
+        char *start = format_uint(end, (uint64_t)st->st_mtime, 16);
+        p = append(p, start, (size_t)(end - start));
+        *p++ = '-';
+        start = format_uint(end, (uint64_t)st->st_size, 16);
+        p = append(p, start, (size_t)(end - start));
+        p = APPEND_LITERAL(p, "\"\r\n");
+    }
+
+    if (content_length < 0) {
+        p = APPEND_LITERAL(p, "Transfer-Encoding: chunked\r\n\r\n");
+    } else {
+        p = APPEND_LITERAL(p, "Content-Length: ");
+        char *start = format_uint(end, (uint64_t)content_length, 10);
+        p = append(p, start, (size_t)(end - start));
+        p = APPEND_LITERAL(p, "\r\n\r\n");
+    }
+    return (size_t)(p - out);
+}
+
+int send_response(int client_fd, int status, const char *content_type,
+                  const char *body, size_t length, int keep_alive, const struct stat *st) {
+    char hdr[RESPONSE_HEADER_MAX];
+    size_t hdr_len = build_response_header(hdr, status, content_type, keep_alive,
+                                           (long long)length, st);
+    if (body == NULL)
+        length = 0;
+
+    struct iovec iov[2] = {
+        { .iov_base = hdr, .iov_len = hdr_len },
+        { .iov_base = (void *)body, .iov_len = length },
+    };
+    struct msghdr msg = { .msg_iov = iov, .msg_iovlen = length ? 2 : 1 };
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(client_fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0) {
+        printf("error in sending: %s\n", strerror(errno));
+        return 0;
+    }
+
+    // Whatever the socket buffer didn't take goes out with backpressure
+    size_t done = (size_t)sent;
+    if (done < hdr_len) {
+        if (!send_all(client_fd, hdr + done, hdr_len - done)) {
+            printf("error in sending: %s\n", strerror(errno));
+            return 0;
+        }
+        done = hdr_len;
+    }
+    trace_mark(TRACE_HEADERS_SENT);
+
+    done -= hdr_len;
+    if (done < length && !send_all(client_fd, body + done, length - done)) {
+        printf("error in sending: %s\n", strerror(errno));
+        return 0;
+    }
+    trace_mark(TRACE_BODY_SENT);
+    return 1;
+}
+
+int send_error_response(int client_fd, int code, int keep_alive) {
+    if (status_index(code) < 0)
+        code = 500;
+    return send_response(client_fd, code, NULL, NULL, 0, keep_alive, NULL);
+}
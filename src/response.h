@@ -0,0 +1,50 @@
+#ifndef RESPONSE_H
+#define RESPONSE_H
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+/**
+ * Response header builder
+ *
+ * The status line, Content-Type and Connection headers for every
+ * (status, content type, keep-alive) combination are string literals
+ * assembled by the preprocessor, so a response header is one memcpy of a
+ * constant block followed by the parts that change: a cached Date,
+ * an optional ETag and the Content-Length digits. No format strings are
+ * parsed per response.
+ */
+
+#define RESPONSE_HEADER_MAX 512
+
+#define HTTP_DATE_LEN 29                 // "Sun, 06 Nov 1994 08:49:37 GMT"
+#define HTTP_DATE_SLOTS 4                // readers may lag a few seconds behind a writer
+
+/**
+ * Build a response header block
+ * @param content_type   - NULL for no Content-Type (error responses)
+ * @param content_length - Body length, or -1 for Transfer-Encoding: chunked
+ * @param st             - File to derive an ETag from, or NULL
+ * @return header length written to out (at most RESPONSE_HEADER_MAX)
+ */
+size_t build_response_header(char *out, int status, const char *content_type, int keep_alive,
+                             long long content_length, const struct stat *st);
+
+/**
+ * Send a complete response; header and body go out in one sendmsg() when
+ * the socket has room
+ * @return 1 on success, 0 on error
+ */
+int send_response(int client_fd, int status, const char *content_type,
+                  const char *body, size_t length, int keep_alive, const struct stat *st);
+
+/**
+ * Write v in decimal (base 10) or hex (base 16) ending just before end
+ * @return start of the digits
+ */
+char *format_uint(char *end, uint64_t v, unsigned base);
+
+int send_error_response(int client_fd, int code, int keep_alive);
+char *get_content_type(const char *filename);
+
+#endif
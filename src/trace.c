@@ -0,0 +1,256 @@
+#include "trace.h"
+#include "netlib.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+/**
+ * Single-producer / single-consumer ring: the connection thread owning
+ * it advances head, the flush thread advances tail.
+ */
+typedef struct trace_ring {
+    atomic_int in_use;
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    _Atomic uint32_t dropped;
+    trace_record records[TRACE_RING_SIZE];
+} trace_ring;
+
+__thread trace_record *g_trace_current = NULL;
+
+static __thread trace_ring *t_ring = NULL;
+static __thread uint32_t t_rng = 0;
+static __thread int t_sampled_unattached = 0;
+
+static trace_ring *g_rings = NULL;
+
+// Sampled requests on connections that found every ring taken
+static _Atomic uint32_t g_unattached_dropped = 0;
+static int g_trace_fd = -1;
+static unsigned g_sample_rate = 1;
+static atomic_int g_flusher_stop = 0;
+static pthread_t g_flusher;
+
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Append all published records to the trace file
+ * Each write() covers whole records, so O_APPEND keeps them intact even
+ * when an old and a new server process share the file during a handoff.
+ */
+static void flush_rings(void) {
+    for (size_t i = 0; i < TRACE_RINGS; i++) {
+        trace_ring *ring = &g_rings[i];
+        uint32_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+        uint32_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+        while (tail != head) {
+            uint32_t start = tail % TRACE_RING_SIZE;
+            uint32_t count = head - tail;
+            if (count > TRACE_RING_SIZE - start)
+                count = TRACE_RING_SIZE - start;  // up to the wrap point
+
+            if (write(g_trace_fd, &ring->records[start], count * sizeof(trace_record)) < 0)
+                log_message(LOG_WARNING, "Trace write failed: %s", strerror(errno));
+            tail += count;
+        }
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+        uint32_t dropped = atomic_exchange(&ring->dropped, 0);
+        if (dropped)
+            log_message(LOG_WARNING, "Trace ring %zu full, dropped %u records", i, dropped);
+    }
+
+    uint32_t unattached = atomic_exchange(&g_unattached_dropped, 0);
+    if (unattached)
+        log_message(LOG_WARNING, "All %d trace rings in use, dropped %u records",
+                    TRACE_RINGS, unattached);
+}
+
+static void *flusher_main(void *arg) {
+    (void)arg;
+
+    // Lifecycle signals are handled by the accept loop only
+    sigset_t mask;
+    sigfillset(&mask);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    struct timespec tick = { .tv_sec = TRACE_FLUSH_MS / 1000,
+                             .tv_nsec = (TRACE_FLUSH_MS % 1000) * 1000000L };
+    while (!atomic_load(&g_flusher_stop)) {
+        nanosleep(&tick, NULL);
+        flush_rings();
+    }
+    return NULL;
+}
+
+/**
+ * Start tracing to a file
+ * @param path        - Binary trace file (appended to)
+ * @param sample_rate - Trace 1 in N requests (0 or 1 = every request)
+ * @return 1 on success, 0 on error
+ */
+int trace_init(const char *path, unsigned sample_rate) {
+    g_sample_rate = sample_rate ? sample_rate : 1;
+
+    g_rings = calloc(TRACE_RINGS, sizeof(trace_ring));
+    if (!g_rings) {
+        log_message(LOG_ERROR, "Trace buffer allocation failed");
+        return 0;
+    }
+
+    g_trace_fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (g_trace_fd < 0) {
+        log_message(LOG_ERROR, "Cannot open trace file '%s': %s", path, strerror(errno));
+        free(g_rings);
+        g_rings = NULL;
+        return 0;
+    }
+
+    struct timespec mono, real;
+    clock_gettime(CLOCK_MONOTONIC, &mono);
+    clock_gettime(CLOCK_REALTIME, &real);
+
+    trace_file_header header = {0};
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.version = TRACE_VERSION;
+    header.record_size = sizeof(trace_record);
+    header.monotonic_base_ns = (uint64_t)mono.tv_sec * 1000000000ULL + (uint64_t)mono.tv_nsec;
+    header.realtime_base_ns = (uint64_t)real.tv_sec * 1000000000ULL + (uint64_t)real.tv_nsec;
+    header.sample_rate = g_sample_rate;
+    header.pid = (uint32_t)getpid();
+
+    if (write(g_trace_fd, &header, sizeof(header)) != (ssize_t)sizeof(header) ||
+        pthread_create(&g_flusher, NULL, flusher_main, NULL) != 0) {
+        log_message(LOG_ERROR, "Trace setup failed: %s", strerror(errno));
+        close(g_trace_fd);
+        g_trace_fd = -1;
+        free(g_rings);
+        g_rings = NULL;
+        return 0;
+    }
+
+    log_message(LOG_INFO, "Tracing 1 in %u requests to %s", g_sample_rate, path);
+    return 1;
+}
+
+/**
+ * Stop the flush thread and write out remaining records
+ * Call after client threads have drained.
+ */
+void trace_shutdown(void) {
+    if (!g_rings)
+        return;
+
+    atomic_store(&g_flusher_stop, 1);
+    pthread_join(g_flusher, NULL);
+    flush_rings();
+    close(g_trace_fd);
+    g_trace_fd = -1;
+}
+
+void trace_thread_attach(void) {
+    if (!g_rings)
+        return;
+
+    size_t i;
+    for (i = 0; i < TRACE_RINGS; i++) {
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&g_rings[i].in_use, &expected, 1)) {
+            t_ring = &g_rings[i];
+            break;
+        }
+    }
+
+    // Seeded even without a ring: sampled requests are still counted as dropped
+    t_rng = (uint32_t)monotonic_ns() ^ (uint32_t)(i * 2654435761u);
+    if (t_rng == 0)
+        t_rng = 1;
+}
+
+void trace_thread_detach(void) {
+    if (!t_ring)
+        return;
+    g_trace_current = NULL;
+    atomic_store(&t_ring->in_use, 0);
+    t_ring = NULL;
+}
+
+/**
+ * Start a record for the next request if it is sampled
+ */
+void trace_begin(void) {
+    g_trace_current = NULL;
+    t_sampled_unattached = 0;
+    if (!g_rings)
+        return;
+
+    if (g_sample_rate > 1) {
+        // xorshift32: per-thread, no shared counter to contend on
+        t_rng ^= t_rng << 13;
+        t_rng ^= t_rng >> 17;
+        t_rng ^= t_rng << 5;
+        if (t_rng % g_sample_rate != 0)
+            return;
+    }
+
+    if (!t_ring) {
+        // More connections than rings: counted in trace_end() so the sample's bias is visible
+        t_sampled_unattached = 1;
+        return;
+    }
+
+    uint32_t head = atomic_load_explicit(&t_ring->head, memory_order_relaxed);
+    uint32_t tail = atomic_load_explicit(&t_ring->tail, memory_order_acquire);
+    if (head - tail >= TRACE_RING_SIZE) {
+        atomic_fetch_add_explicit(&t_ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+
+    trace_record *record = &t_ring->records[head % TRACE_RING_SIZE];
+    memset(record, 0, sizeof(*record));
+    record->start_ns = monotonic_ns();
+    record->thread_id = (uint32_t)(t_ring - g_rings);
+    g_trace_current = record;
+}
+
+void trace_mark_slow(trace_stage stage) {
+    uint64_t elapsed = monotonic_ns() - g_trace_current->start_ns;
+    // Offsets saturate at ~4.3s (long followed streams); 0 means "not reached"
+    if (elapsed > UINT32_MAX)
+        elapsed = UINT32_MAX;
+    g_trace_current->stage_ns[stage] = elapsed ? (uint32_t)elapsed : 1;
+}
+
+/**
+ * Finish the current record and publish it to the flush thread
+ */
+void trace_end(int status, size_t bytes) {
+    if (t_sampled_unattached) {
+        t_sampled_unattached = 0;
+        atomic_fetch_add_explicit(&g_unattached_dropped, 1, memory_order_relaxed);
+    }
+
+    trace_record *record = g_trace_current;
+    if (!record)
+        return;
+
+    record->status = (uint16_t)status;
+    record->bytes = bytes;
+    g_trace_current = NULL;
+
+    uint32_t head = atomic_load_explicit(&t_ring->head, memory_order_relaxed);
+    atomic_store_explicit(&t_ring->head, head + 1, memory_order_release);
+}
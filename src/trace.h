@@ -0,0 +1,75 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * Request tracing
+ *
+ * Sampled requests get a CLOCK_MONOTONIC timestamp at each stage of
+ * handel_client. Records go into preallocated per-thread ring buffers
+ * (no locks, no allocation on the request path) and a background thread
+ * appends them to a binary trace file once a second.
+ *
+ * File layout: trace_file_header, then trace_record entries. A server
+ * started by a SIGUSR2 handoff appends its own header to the same file.
+ * tools/tracedump.c converts the file to Chrome trace / Perfetto JSON and
+ * prints per-stage percentiles.
+ */
+
+#define TRACE_MAGIC        "HTTPTRC1"
+#define TRACE_VERSION      1
+#define TRACE_RINGS        64      // connection threads traced at once
+#define TRACE_RING_SIZE    512     // records per ring
+#define TRACE_FLUSH_MS     1000
+
+typedef enum {
+    TRACE_RECV,          // request bytes received
+    TRACE_PARSED,        // request line and headers parsed
+    TRACE_OPENED,        // file or directory opened
+    TRACE_HEADERS_SENT,  // response headers sent
+    TRACE_BODY_SENT,     // response body sent
+    TRACE_STAGE_COUNT
+} trace_stage;
+
+typedef struct trace_file_header {
+    char magic[8];                 // TRACE_MAGIC
+    uint32_t version;
+    uint32_t record_size;          // sizeof(trace_record)
+    uint64_t monotonic_base_ns;    // CLOCK_MONOTONIC when tracing started
+    uint64_t realtime_base_ns;     // wall clock at the same moment
+    uint32_t sample_rate;          // 1 in N requests traced
+    uint32_t pid;
+} trace_file_header;
+
+typedef struct trace_record {
+    uint64_t start_ns;                      // CLOCK_MONOTONIC, request start
+    uint32_t stage_ns[TRACE_STAGE_COUNT];   // offset from start, 0 = not reached
+    uint32_t thread_id;                     // ring index
+    uint16_t status;                        // HTTP status code
+    uint16_t reserved;
+    uint32_t pad;
+    uint64_t bytes;                         // body bytes sent
+} trace_record;
+
+// Record of the request being traced on this thread, NULL if none
+extern __thread trace_record *g_trace_current;
+
+int trace_init(const char *path, unsigned sample_rate);
+void trace_shutdown(void);
+
+// Claim / release a ring for the calling connection thread
+void trace_thread_attach(void);
+void trace_thread_detach(void);
+
+void trace_begin(void);
+void trace_mark_slow(trace_stage stage);
+void trace_end(int status, size_t bytes);
+
+// Cheap when the request isn't sampled: one thread-local load
+static inline void trace_mark(trace_stage stage) {
+    if (g_trace_current)
+        trace_mark_slow(stage);
+}
+
+#endif
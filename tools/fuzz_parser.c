@@ -0,0 +1,72 @@
+/**
+ * libFuzzer target for everything that reads raw request bytes:
+ * parse_http_request, get_header_value and the proxy's upstream request
+ * rewrite (proxy_build_request).
+ *
+ * Build and run (clang):
+ *   clang -g -O1 -fsanitize=fuzzer,address,undefined tools/fuzz_parser.c src/netlib.c \
+ *       src/ratelimit.c src/autoindex.c src/trace.c src/proxy.c src/response.c \
+ *       -I src -pthread -o fuzz_parser
+ *   ./fuzz_parser corpus/
+ *
+ * Without libFuzzer (e.g. gcc), -DFUZZ_STANDALONE adds a main() that runs
+ * each file given on the command line once, to replay a crash:
+ *   gcc -g -fsanitize=address,undefined -DFUZZ_STANDALONE tools/fuzz_parser.c ... -o fuzz_parser
+ *   ./fuzz_parser crash-<hash>
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include "netlib.h"
+#include "proxy.h"
+
+// Normally defined in main.c
+char *g_directory = NULL;
+char *g_single_file = NULL;
+volatile sig_atomic_t g_draining = 0;
+atomic_int g_active_connections = 0;
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+    // Same 4KB, NUL-terminated buffer the server receives into
+    char req[4096];
+    if (size > sizeof(req) - 1)
+        size = sizeof(req) - 1;
+    memcpy(req, data, size);
+    req[size] = '\0';
+
+    http_request parsed = parse_http_request(req, size);
+
+    char value[256];
+    get_header_value(req, "Connection", value, sizeof(value));
+    get_header_value(req, "Expect", value, sizeof(value));
+
+    // proxy_forward only rewrites requests the parser accepted
+    const char *hdr_end = memmem(req, size, "\r\n\r\n", 4);
+    if (parsed.valid && hdr_end) {
+        char out[PROXY_HEADER_MAX];
+        proxy_build_request(req, hdr_end, "2001:db8::1", out, sizeof(out));
+    }
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+int main(int ac, char **av) {
+    for (int i = 1; i < ac; i++) {
+        FILE *fp = fopen(av[i], "rb");
+        if (!fp) {
+            perror(av[i]);
+            return 1;
+        }
+        static uint8_t buf[65536];
+        size_t len = fread(buf, 1, sizeof(buf), fp);
+        fclose(fp);
+        LLVMFuzzerTestOneInput(buf, len);
+    }
+    return 0;
+}
+#endif
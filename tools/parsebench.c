@@ -0,0 +1,288 @@
+/**
+ * Measure ns/request for request parsing and routing helpers
+ * (parse_http_request, get_header_value, get_content_type, ends_with,
+ * remove_first_n_copy) over a corpus of browser requests.
+ *
+ * Build:
+ *   gcc -O2 -pthread tools/parsebench.c src/netlib.c src/ratelimit.c src/autoindex.c \
+ *       src/trace.c src/proxy.c src/response.c -I src -o parsebench
+ *
+ * Usage:
+ *   ./parsebench                  Built-in corpus, 1000000 requests
+ *   ./parsebench -n <count>       Number of requests to time
+ *   ./parsebench -f <corpus>      Raw requests, each ending with a blank line
+ *                                 (LF line endings are converted to CRLF)
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include "netlib.h"
+
+// Normally defined in main.c
+char *g_directory = NULL;
+char *g_single_file = NULL;
+volatile sig_atomic_t g_draining = 0;
+atomic_int g_active_connections = 0;
+
+#define MAX_REQUESTS 1024
+
+static const char *builtin_corpus[] = {
+    // Chrome, page load
+    "GET / HTTP/1.1\r\n"
+    "Host: localhost:4221\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,"
+    "image/apng,*/*;q=0.8,application/signed-exchange;v=b3;q=0.7\r\n"
+    "Sec-Fetch-Site: none\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-User: ?1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n",
+
+    // Chrome, stylesheet
+    "GET /css/style.css HTTP/1.1\r\n"
+    "Host: localhost:4221\r\n"
+    "Connection: keep-alive\r\n"
+    "sec-ch-ua-platform: \"Linux\"\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64) AppleWebKit/537.36 (KHTML, like Gecko) "
+    "Chrome/124.0.0.0 Safari/537.36\r\n"
+    "sec-ch-ua: \"Chromium\";v=\"124\", \"Google Chrome\";v=\"124\", \"Not-A.Brand\";v=\"99\"\r\n"
+    "sec-ch-ua-mobile: ?0\r\n"
+    "Accept: text/css,*/*;q=0.1\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Dest: style\r\n"
+    "Referer: http://localhost:4221/\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Accept-Language: en-US,en;q=0.9\r\n"
+    "\r\n",
+
+    // Firefox, image
+    "GET /images/logo.png HTTP/1.1\r\n"
+    "Host: localhost:4221\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: image/avif,image/webp,*/*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://localhost:4221/\r\n"
+    "Sec-Fetch-Dest: image\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "\r\n",
+
+    // Firefox, script with query string
+    "GET /js/app.js?v=3 HTTP/1.1\r\n"
+    "Host: localhost:4221\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: */*\r\n"
+    "Accept-Language: en-US,en;q=0.5\r\n"
+    "Accept-Encoding: gzip, deflate, br\r\n"
+    "Connection: keep-alive\r\n"
+    "Referer: http://localhost:4221/\r\n"
+    "Sec-Fetch-Dest: script\r\n"
+    "Sec-Fetch-Mode: no-cors\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "If-None-Match: \"6ad5751d-1f4\"\r\n"
+    "\r\n",
+
+    // Safari, JSON listing
+    "GET /docs/?format=json HTTP/1.1\r\n"
+    "Host: localhost:4221\r\n"
+    "Accept: application/json\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Accept-Language: en-GB,en;q=0.9\r\n"
+    "Accept-Encoding: gzip, deflate\r\n"
+    "Sec-Fetch-Mode: cors\r\n"
+    "User-Agent: Mozilla/5.0 (Macintosh; Intel Mac OS X 10_15_7) AppleWebKit/605.1.15 "
+    "(KHTML, like Gecko) Version/17.4 Safari/605.1.15\r\n"
+    "Referer: http://localhost:4221/docs/\r\n"
+    "Sec-Fetch-Dest: empty\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n",
+
+    // curl
+    "GET /downloads/archive.tar.gz HTTP/1.1\r\n"
+    "Host: localhost:4221\r\n"
+    "User-Agent: curl/8.5.0\r\n"
+    "Accept: */*\r\n"
+    "\r\n",
+
+    // API call through the proxy
+    "POST /api/items HTTP/1.1\r\n"
+    "Host: localhost:4221\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:125.0) Gecko/20100101 Firefox/125.0\r\n"
+    "Accept: application/json\r\n"
+    "Content-Type: application/json\r\n"
+    "Content-Length: 27\r\n"
+    "Origin: http://localhost:4221\r\n"
+    "Connection: keep-alive\r\n"
+    "\r\n"
+    "{\"name\":\"item\",\"count\":42}\n",
+};
+
+typedef struct corpus {
+    char *requests[MAX_REQUESTS];
+    size_t count;
+} corpus;
+
+static uint64_t monotonic_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + (uint64_t)ts.tv_nsec;
+}
+
+/**
+ * Load raw requests from a file; each request ends with a blank line
+ */
+static int load_corpus(const char *path, corpus *c) {
+    FILE *fp = fopen(path, "rb");
+    if (!fp) {
+        perror(path);
+        return 0;
+    }
+
+    char request[4096];
+    size_t used = 0;
+    char line[4096];
+    while (fgets(line, sizeof(line), fp) && c->count < MAX_REQUESTS) {
+        size_t len = strcspn(line, "\r\n");
+        if (used + len + 2 < sizeof(request)) {
+            memcpy(request + used, line, len);
+            used += len;
+            memcpy(request + used, "\r\n", 2);
+            used += 2;
+        }
+        if (len == 0 && used > 2) {
+            request[used] = '\0';
+            c->requests[c->count++] = strdup(request);
+            used = 0;
+        } else if (len == 0) {
+            used = 0;  // blank lines between requests
+        }
+    }
+    fclose(fp);
+    return c->count > 0;
+}
+
+int main(int ac, char **av) {
+    long iterations = 1000000;
+    const char *corpus_path = NULL;
+    int opt;
+
+    while ((opt = getopt(ac, av, "n:f:h")) != -1) {
+        switch (opt) {
+            case 'n':
+                iterations = atol(optarg);
+                break;
+            case 'f':
+                corpus_path = optarg;
+                break;
+            case 'h':
+            default:
+                fprintf(stderr, "Usage: %s [-n count] [-f corpus]\n", av[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (iterations <= 0) {
+        fprintf(stderr, "Error: Invalid count\n");
+        return 1;
+    }
+
+    corpus c = { .count = 0 };
+    if (corpus_path) {
+        if (!load_corpus(corpus_path, &c)) {
+            fprintf(stderr, "No requests in %s\n", corpus_path);
+            return 1;
+        }
+    } else {
+        for (size_t i = 0; i < sizeof(builtin_corpus) / sizeof(builtin_corpus[0]); i++)
+            c.requests[c.count++] = strdup(builtin_corpus[i]);
+    }
+
+    // Same 4KB, NUL-terminated buffer the server receives into
+    static char bufs[MAX_REQUESTS][4096];
+    size_t lens[MAX_REQUESTS];
+    http_request parsed[MAX_REQUESTS];
+    for (size_t i = 0; i < c.count; i++) {
+        snprintf(bufs[i], sizeof(bufs[i]), "%s", c.requests[i]);
+        lens[i] = strlen(bufs[i]);
+        parsed[i] = parse_http_request(bufs[i], lens[i]);
+        if (!parsed[i].valid)
+            fprintf(stderr, "Warning: request %zu does not parse\n", i);
+    }
+
+    /**
+     * One timed pass per function, so the clock isn't read per call;
+     * requests rotate through the corpus so branches see real variety
+     */
+    volatile size_t sink = 0;
+    char value[256];
+    uint64_t elapsed[5];
+    const char *names[5] = {
+        "parse_http_request", "get_header_value x2", "get_content_type",
+        "ends_with", "remove_first_n_copy"
+    };
+
+    uint64_t start = monotonic_ns();
+    for (long n = 0; n < iterations; n++) {
+        size_t i = (size_t)n % c.count;
+        http_request r = parse_http_request(bufs[i], lens[i]);
+        sink += (size_t)r.valid;
+    }
+    elapsed[0] = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    for (long n = 0; n < iterations; n++) {
+        char *req = bufs[(size_t)n % c.count];
+        sink += (size_t)get_header_value(req, "Connection", value, sizeof(value));
+        sink += (size_t)get_header_value(req, "Accept", value, sizeof(value));
+    }
+    elapsed[1] = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    for (long n = 0; n < iterations; n++)
+        sink += (size_t)get_content_type(parsed[(size_t)n % c.count].path);
+    elapsed[2] = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    for (long n = 0; n < iterations; n++)
+        sink += (size_t)ends_with(parsed[(size_t)n % c.count].path, "/");
+    elapsed[3] = monotonic_ns() - start;
+
+    start = monotonic_ns();
+    for (long n = 0; n < iterations; n++) {
+        char *rest = remove_first_n_copy(parsed[(size_t)n % c.count].path, 1);
+        sink += rest ? (size_t)rest[0] : 0;
+        free(rest);
+    }
+    elapsed[4] = monotonic_ns() - start;
+    (void)sink;
+
+    uint64_t total = 0;
+    printf("%ld requests, corpus of %zu\n", iterations, c.count);
+    printf("%-24s %10s\n", "function", "ns/request");
+    for (int f = 0; f < 5; f++) {
+        printf("%-24s %10.1f\n", names[f], (double)elapsed[f] / (double)iterations);
+        total += elapsed[f];
+    }
+    printf("%-24s %10.1f\n", "total", (double)total / (double)iterations);
+
+    for (size_t i = 0; i < c.count; i++)
+        free(c.requests[i]);
+    return 0;
+}
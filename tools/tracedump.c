@@ -0,0 +1,208 @@
+/**
+ * Convert a server trace file (-t) to Chrome trace / Perfetto JSON
+ * and print per-stage latency percentiles.
+ *
+ * Build:
+ *   gcc tools/tracedump.c -I src -o tracedump
+ *
+ * Usage:
+ *   ./tracedump <trace.bin>                  Print percentiles
+ *   ./tracedump <trace.bin> -j <out.json>    Also write JSON for ui.perfetto.dev
+ *                                            or chrome://tracing
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include "trace.h"
+
+// Durations per stage, plus the whole request in the last column
+#define SPAN_COUNT (TRACE_STAGE_COUNT + 1)
+
+static const char *span_names[SPAN_COUNT] = {
+    "recv", "parse", "open", "headers", "body", "total"
+};
+
+typedef struct duration_list {
+    uint64_t *values;
+    size_t count;
+    size_t cap;
+} duration_list;
+
+
+static int push_duration(duration_list *list, uint64_t value) {
+    if (list->count == list->cap) {
+        size_t cap = list->cap ? list->cap * 2 : 1024;
+        uint64_t *grown = realloc(list->values, cap * sizeof(uint64_t));
+        if (!grown)
+            return 0;
+        list->values = grown;
+        list->cap = cap;
+    }
+    list->values[list->count++] = value;
+    return 1;
+}
+
+static int compare_u64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile_us(const duration_list *list, double p) {
+    size_t index = (size_t)(p * (double)(list->count - 1) + 0.5);
+    return (double)list->values[index] / 1000.0;
+}
+
+/**
+ * Write one request as a parent slice with one child slice per stage
+ */
+static void write_json_record(FILE *out, const trace_record *rec, uint64_t base_ns,
+                              uint32_t pid, int *first) {
+    double start_us = (double)(rec->start_ns - base_ns) / 1000.0;
+    uint32_t end = 0;
+    for (int s = 0; s < TRACE_STAGE_COUNT; s++) {
+        if (rec->stage_ns[s] > end)
+            end = rec->stage_ns[s];
+    }
+
+    fprintf(out, "%s\n{\"name\":\"request %u\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+                 "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"status\":%u,\"bytes\":%llu}}",
+            *first ? "" : ",", rec->status, pid, rec->thread_id, start_us,
+            (double)end / 1000.0, rec->status, (unsigned long long)rec->bytes);
+    *first = 0;
+
+    uint32_t prev = 0;
+    for (int s = 0; s < TRACE_STAGE_COUNT; s++) {
+        if (!rec->stage_ns[s])
+            continue;
+        fprintf(out, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,"
+                     "\"ts\":%.3f,\"dur\":%.3f}",
+                span_names[s], pid, rec->thread_id,
+                start_us + (double)prev / 1000.0,
+                (double)(rec->stage_ns[s] - prev) / 1000.0);
+        prev = rec->stage_ns[s];
+    }
+}
+
+int main(int ac, char **av) {
+    const char *json_path = NULL;
+    int opt;
+
+    while ((opt = getopt(ac, av, "j:h")) != -1) {
+        switch (opt) {
+            case 'j':
+                json_path = optarg;
+                break;
+            case 'h':
+            default:
+                fprintf(stderr, "Usage: %s <trace.bin> [-j out.json]\n", av[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+    if (optind >= ac) {
+        fprintf(stderr, "Usage: %s <trace.bin> [-j out.json]\n", av[0]);
+        return 1;
+    }
+
+    FILE *in = fopen(av[optind], "rb");
+    if (!in) {
+        perror(av[optind]);
+        return 1;
+    }
+
+    FILE *json = NULL;
+    if (json_path) {
+        json = fopen(json_path, "w");
+        if (!json) {
+            perror(json_path);
+            fclose(in);
+            return 1;
+        }
+        fprintf(json, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[");
+    }
+
+    duration_list spans[SPAN_COUNT] = {{0}};
+    size_t records = 0;
+    uint64_t base_ns = 0;
+    uint32_t pid = 0;
+    int have_header = 0;
+    int first = 1;
+
+    /**
+     * Each server process writes a header followed by its records; a
+     * handoff appends a new header, so check for the magic before each read.
+     */
+    for (;;) {
+        char magic[8];
+        if (fread(magic, 1, sizeof(magic), in) != sizeof(magic))
+            break;
+
+        if (memcmp(magic, TRACE_MAGIC, sizeof(magic)) == 0) {
+            trace_file_header header;
+            memcpy(header.magic, magic, sizeof(magic));
+            if (fread((char *)&header + sizeof(magic), 1, sizeof(header) - sizeof(magic), in) !=
+                sizeof(header) - sizeof(magic))
+                break;
+            if (header.version != TRACE_VERSION || header.record_size != sizeof(trace_record)) {
+                fprintf(stderr, "Unsupported trace version %u (record size %u)\n",
+                        header.version, header.record_size);
+                break;
+            }
+            if (!have_header)
+                base_ns = header.monotonic_base_ns;
+            pid = header.pid;
+            have_header = 1;
+            continue;
+        }
+
+        if (!have_header) {
+            fprintf(stderr, "Not a trace file: %s\n", av[optind]);
+            break;
+        }
+
+        trace_record rec;
+        memcpy(&rec, magic, sizeof(magic));
+        if (fread((char *)&rec + sizeof(magic), 1, sizeof(rec) - sizeof(magic), in) !=
+            sizeof(rec) - sizeof(magic))
+            break;
+        records++;
+
+        uint32_t prev = 0;
+        for (int s = 0; s < TRACE_STAGE_COUNT; s++) {
+            if (!rec.stage_ns[s])
+                continue;
+            push_duration(&spans[s], rec.stage_ns[s] - prev);
+            prev = rec.stage_ns[s];
+        }
+        push_duration(&spans[TRACE_STAGE_COUNT], prev);
+
+        if (json)
+            write_json_record(json, &rec, base_ns, pid, &first);
+    }
+    fclose(in);
+
+    if (json) {
+        fprintf(json, "\n]}\n");
+        fclose(json);
+    }
+
+    printf("%zu requests\n", records);
+    printf("%-8s %10s %10s %10s %10s %10s %10s\n",
+           "stage", "count", "p50(us)", "p90(us)", "p99(us)", "p99.9(us)", "max(us)");
+    for (int s = 0; s < SPAN_COUNT; s++) {
+        duration_list *list = &spans[s];
+        if (list->count == 0)
+            continue;
+        qsort(list->values, list->count, sizeof(uint64_t), compare_u64);
+        printf("%-8s %10zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+               span_names[s], list->count,
+               percentile_us(list, 0.50), percentile_us(list, 0.90),
+               percentile_us(list, 0.99), percentile_us(list, 0.999),
+               (double)list->values[list->count - 1] / 1000.0);
+        free(list->values);
+    }
+    return 0;
+}